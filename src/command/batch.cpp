@@ -0,0 +1,144 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ *
+ * Implements PipelineBatch, which builds Pipelines on a pool of threads, and
+ * AsyncPipeline, which builds a Pipeline on a background thread.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "command.h"
+
+namespace command {
+
+int PipelineBatch::forEach(size_t n, size_t maxThreads,
+                           std::function<int(size_t)> fn,
+                           std::vector<size_t>& failed) {
+  failed.clear();
+  if (!maxThreads) {
+    maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::atomic<size_t> next{0};
+  std::mutex failedMutex;
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < n;) {
+      if (fn(i)) {
+        std::lock_guard<std::mutex> lock(failedMutex);
+        failed.emplace_back(i);
+      }
+    }
+  };
+
+  // The calling thread is one of the workers, so only start maxThreads - 1.
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < std::min(maxThreads, n); t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : threads) {
+    t.join();
+  }
+  std::sort(failed.begin(), failed.end());
+  return failed.empty() ? 0 : 1;
+}
+
+int PipelineBatch::ctorError() {
+  for (size_t i = 0; i < pipelines.size(); i++) {
+    if (!pipelines.at(i)) {
+      logE("PipelineBatch::ctorError: pipelines[%zu] is NULL\n", i);
+      return 1;
+    }
+  }
+  // A derivative reads basePipe->vk while it is created, so if its basePipe
+  // is also in this batch, build them in order on the calling thread.
+  size_t threads = maxThreads;
+  for (auto& pipe : pipelines) {
+    auto base = pipe->basePipe.lock();
+    if (base && std::find(pipelines.begin(), pipelines.end(), base) !=
+                    pipelines.end()) {
+      threads = 1;
+    }
+  }
+  std::vector<size_t> failed;
+  if (forEach(
+          pipelines.size(), threads,
+          [this](size_t i) -> int { return pipelines.at(i)->ctorError(cpool); },
+          failed)) {
+    for (auto i : failed) {
+      logE("PipelineBatch::ctorError: pipelines[%zu].ctorError failed\n", i);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+AsyncPipeline::~AsyncPipeline() {
+  if (result.valid()) {
+    result.wait();
+  }
+}
+
+int AsyncPipeline::ctorError(RenderPass& pass, size_t subpass_i) {
+  if (!pipe) {
+    logE("AsyncPipeline::ctorError: pipe is NULL\n");
+    return 1;
+  }
+  if (result.valid()) {
+    logE("AsyncPipeline::ctorError: already building\n");
+    return 1;
+  }
+  if (subpass_i >= pass.pipelines.size()) {
+    logE("AsyncPipeline::ctorError: subpass_i=%zu when pipelines.size=%zu\n",
+         subpass_i, pass.pipelines.size());
+    return 1;
+  }
+  started = true;
+  status = 0;
+  auto p = pipe;
+  result = std::async(std::launch::async, [p, &pass, subpass_i]() -> int {
+    return p->ctorError(pass, subpass_i);
+  });
+  return 0;
+}
+
+int AsyncPipeline::ctorError(CommandPool& computeCommandPool) {
+  if (!pipe) {
+    logE("AsyncPipeline::ctorError: pipe is NULL\n");
+    return 1;
+  }
+  if (result.valid()) {
+    logE("AsyncPipeline::ctorError: already building\n");
+    return 1;
+  }
+  started = true;
+  status = 0;
+  auto p = pipe;
+  result = std::async(std::launch::async, [p, &computeCommandPool]() -> int {
+    return p->ctorError(computeCommandPool);
+  });
+  return 0;
+}
+
+bool AsyncPipeline::isReady() {
+  if (!result.valid()) {
+    return started;
+  }
+  return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+bool AsyncPipeline::isFailed() { return wait() != 0; }
+
+int AsyncPipeline::wait() {
+  if (result.valid()) {
+    status = result.get();
+  } else if (!started) {
+    logE("AsyncPipeline::wait: ctorError was not called\n");
+    return 1;
+  }
+  return status;
+}
+
+}  // namespace command
@@ -1,5 +1,8 @@
 /* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
  */
+#include <algorithm>
+#include <thread>
+
 #include "command.h"
 
 namespace command {
@@ -8,6 +11,219 @@ CommandPool::~CommandPool() {}
 
 CommandBuffer::~CommandBuffer() {}
 
+void CommandBuffer::ShadowState::reset() {
+  graphics = BindPointState();
+  compute = BindPointState();
+  vertexBuffers.clear();
+  indexBuf = VK_NULL_HANDLE;
+  resetDynamic();
+}
+
+void CommandBuffer::ShadowState::resetDynamic() {
+  viewports.clear();
+  scissors.clear();
+  floatValid = 0;
+}
+
+CommandBuffer::ShadowState::BindPointState*
+CommandBuffer::ShadowState::getBindPoint(VkPipelineBindPoint bindPoint) {
+  switch (bindPoint) {
+    case VK_PIPELINE_BIND_POINT_GRAPHICS:
+      return &graphics;
+    case VK_PIPELINE_BIND_POINT_COMPUTE:
+      return &compute;
+    default:
+      return nullptr;
+  }
+}
+
+bool CommandBuffer::ShadowState::redundantPipeline(
+    VkPipelineBindPoint bindPoint, VkPipeline pipe) {
+  BindPointState* bp = getBindPoint(bindPoint);
+  if (!enabled || !bp) {
+    return false;
+  }
+  if (bp->pipe == pipe) {
+    elided++;
+    return true;
+  }
+  bp->pipe = pipe;
+  if (bindPoint == VK_PIPELINE_BIND_POINT_GRAPHICS) {
+    // Any state the new pipeline does not mark as dynamic is overwritten.
+    resetDynamic();
+  }
+  return false;
+}
+
+bool CommandBuffer::ShadowState::redundantDescriptorSets(
+    VkPipelineBindPoint bindPoint, VkPipelineLayout layout, uint32_t firstSet,
+    uint32_t descriptorSetCount, const VkDescriptorSet* pDescriptorSets,
+    uint32_t dynamicOffsetCount, const uint32_t* pDynamicOffsets) {
+  BindPointState* bp = getBindPoint(bindPoint);
+  if (!enabled || !bp) {
+    return false;
+  }
+  if (bp->layout != layout) {
+    // A different layout may disturb the other sets. Forget them all.
+    bp->layout = layout;
+    bp->sets.clear();
+  }
+  if (bp->sets.size() < firstSet + descriptorSetCount) {
+    bp->sets.resize(firstSet + descriptorSetCount);
+  }
+  // Dynamic offsets can only be attributed to a set if there is just one set.
+  bool canTrack = descriptorSetCount == 1 || dynamicOffsetCount == 0;
+  std::vector<uint32_t> offsets(pDynamicOffsets,
+                                pDynamicOffsets + dynamicOffsetCount);
+  bool same = canTrack;
+  for (uint32_t i = 0; i < descriptorSetCount && same; i++) {
+    auto& b = bp->sets.at(firstSet + i);
+    same = b.ds != VK_NULL_HANDLE && b.ds == pDescriptorSets[i] &&
+           b.dynamicOffsets == offsets;
+  }
+  if (same) {
+    elided++;
+    return true;
+  }
+  for (uint32_t i = 0; i < descriptorSetCount; i++) {
+    auto& b = bp->sets.at(firstSet + i);
+    b.ds = canTrack ? pDescriptorSets[i] : VK_NULL_HANDLE;
+    b.dynamicOffsets = offsets;
+  }
+  return false;
+}
+
+void CommandBuffer::ShadowState::forgetDescriptorSet(
+    VkPipelineBindPoint bindPoint, uint32_t set) {
+  BindPointState* bp = getBindPoint(bindPoint);
+  if (bp && set < bp->sets.size()) {
+    bp->sets.at(set) = BoundSet();
+  }
+}
+
+bool CommandBuffer::ShadowState::redundantVertexBuffers(
+    uint32_t firstBinding, uint32_t bindingCount, const VkBuffer* pBuffers,
+    const VkDeviceSize* pOffsets) {
+  if (!enabled) {
+    return false;
+  }
+  if (vertexBuffers.size() < firstBinding + bindingCount) {
+    vertexBuffers.resize(firstBinding + bindingCount,
+                         std::make_pair(VK_NULL_HANDLE, VkDeviceSize(0)));
+  }
+  bool same = true;
+  for (uint32_t i = 0; i < bindingCount; i++) {
+    auto& b = vertexBuffers.at(firstBinding + i);
+    if (b.first == VK_NULL_HANDLE || b.first != pBuffers[i] ||
+        b.second != pOffsets[i]) {
+      same = false;
+      b = std::make_pair(pBuffers[i], pOffsets[i]);
+    }
+  }
+  if (same) {
+    elided++;
+  }
+  return same;
+}
+
+bool CommandBuffer::ShadowState::redundantIndexBuffer(VkBuffer buf,
+                                                      VkDeviceSize offset,
+                                                      VkIndexType type) {
+  if (!enabled) {
+    return false;
+  }
+  if (indexBuf != VK_NULL_HANDLE && indexBuf == buf && indexOffset == offset &&
+      indexType == type) {
+    elided++;
+    return true;
+  }
+  indexBuf = buf;
+  indexOffset = offset;
+  indexType = type;
+  return false;
+}
+
+bool CommandBuffer::ShadowState::redundantViewports(
+    uint32_t first, uint32_t count, const VkViewport* pViewports) {
+  if (!enabled) {
+    return false;
+  }
+  // viewports.size() is only extended to the contiguous range that is known.
+  if (first > viewports.size()) {
+    return false;
+  }
+  if (first + count <= viewports.size() &&
+      !memcmp(&viewports.at(first), pViewports, sizeof(*pViewports) * count)) {
+    elided++;
+    return true;
+  }
+  if (viewports.size() < first + count) {
+    viewports.resize(first + count);
+  }
+  memcpy(&viewports.at(first), pViewports, sizeof(*pViewports) * count);
+  return false;
+}
+
+bool CommandBuffer::ShadowState::redundantScissors(uint32_t first,
+                                                   uint32_t count,
+                                                   const VkRect2D* pScissors) {
+  if (!enabled) {
+    return false;
+  }
+  // scissors.size() is only extended to the contiguous range that is known.
+  if (first > scissors.size()) {
+    return false;
+  }
+  if (first + count <= scissors.size() &&
+      !memcmp(&scissors.at(first), pScissors, sizeof(*pScissors) * count)) {
+    elided++;
+    return true;
+  }
+  if (scissors.size() < first + count) {
+    scissors.resize(first + count);
+  }
+  memcpy(&scissors.at(first), pScissors, sizeof(*pScissors) * count);
+  return false;
+}
+
+bool CommandBuffer::ShadowState::redundantFloats(uint32_t bit, size_t first,
+                                                 size_t count,
+                                                 const float* values) {
+  if (!enabled) {
+    return false;
+  }
+  if ((floatValid & bit) &&
+      !memcmp(&floats[first], values, sizeof(*values) * count)) {
+    elided++;
+    return true;
+  }
+  floatValid |= bit;
+  memcpy(&floats[first], values, sizeof(*values) * count);
+  return false;
+}
+
+bool CommandBuffer::ShadowState::redundantLineWidth(float lineWidth) {
+  return redundantFloats(1, 0, 1, &lineWidth);
+}
+
+bool CommandBuffer::ShadowState::redundantBlendConstants(
+    const float blendConstants[4]) {
+  return redundantFloats(2, 1, 4, blendConstants);
+}
+
+bool CommandBuffer::ShadowState::redundantDepthBias(float constantFactor,
+                                                    float clamp,
+                                                    float slopeFactor) {
+  float v[3] = {constantFactor, clamp, slopeFactor};
+  return redundantFloats(4, 5, 3, v);
+}
+
+bool CommandBuffer::ShadowState::redundantDepthBounds(float minBound,
+                                                      float maxBound) {
+  float v[2] = {minBound, maxBound};
+  return redundantFloats(8, 8, 2, v);
+}
+
 int CommandPool::ctorError(VkCommandPoolCreateFlags flags) {
   if (queueFamily == language::NONE) {
     logE("CommandPool::queueFamily must be set before calling ctorError\n");
@@ -70,12 +286,24 @@ int CommandPool::submit(lock_guard_t& lock, size_t poolQindex,
   raw.resize(info.size());
   rawSem.resize(info.size());
   rawStage.resize(info.size());
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+  std::vector<VkTimelineSemaphoreSubmitInfoKHR> rawTimeline(info.size());
+  std::vector<std::vector<uint64_t>> rawWaitValue(info.size());
+  std::vector<std::vector<uint64_t>> rawSignalValue(info.size());
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
 
   for (size_t i = 0; i < info.size(); i++) {
     VkSubmitInfo& out = raw.at(i);
+    bool isTimeline = !info.at(i).signalValues.empty();
     for (auto& ss : info.at(i).waitFor) {
       rawSem.at(i).emplace_back(ss.sem);
       rawStage.at(i).emplace_back(ss.dstStage);
+      isTimeline |= ss.timeline;
+    }
+    if (info.at(i).signalValues.size() > info.at(i).toSignal.size()) {
+      logE("submit: info[%zu] has %zu signalValues but %zu toSignal\n", i,
+           info.at(i).signalValues.size(), info.at(i).toSignal.size());
+      return 1;
     }
 
     memset(&out, 0, sizeof(out));
@@ -87,6 +315,27 @@ int CommandPool::submit(lock_guard_t& lock, size_t poolQindex,
     out.pCommandBuffers = info.at(i).cmdBuffers.data();
     out.signalSemaphoreCount = info.at(i).toSignal.size();
     out.pSignalSemaphores = info.at(i).toSignal.data();
+    if (!isTimeline) {
+      continue;
+    }
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+    for (auto& ss : info.at(i).waitFor) {
+      rawWaitValue.at(i).emplace_back(ss.value);
+    }
+    rawSignalValue.at(i) = info.at(i).signalValues;
+    rawSignalValue.at(i).resize(info.at(i).toSignal.size(), 0);
+    auto& t = rawTimeline.at(i);
+    memset(&t, 0, sizeof(t));
+    t.sType = autoSType(t);
+    t.waitSemaphoreValueCount = rawWaitValue.at(i).size();
+    t.pWaitSemaphoreValues = rawWaitValue.at(i).data();
+    t.signalSemaphoreValueCount = rawSignalValue.at(i).size();
+    t.pSignalSemaphoreValues = rawSignalValue.at(i).data();
+    out.pNext = &t;
+#else  /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
+    logE("submit: info[%zu] has timeline values, not in this vulkan.h\n", i);
+    return 1;
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
   }
 
   VkResult v = vkQueueSubmit(q(poolQindex), raw.size(), raw.data(), fence);
@@ -194,21 +443,69 @@ int CommandPool::unborrowOneTimeBuffer(VkCommandBuffer buf) {
   return 0;
 }
 
+size_t CommandPool::getFenceShard() const {
+  return std::hash<std::thread::id>()(std::this_thread::get_id()) %
+         fenceShardCount;
+}
+
+int CommandPool::resetDirty(FenceShard& shard) {
+  if (shard.dirty.empty()) {
+    return 0;
+  }
+  std::vector<VkFence> raw;
+  for (auto& f : shard.dirty) {
+    raw.emplace_back(f->vk);
+  }
+  VkResult v = vkResetFences(vk.dev.dev, raw.size(), raw.data());
+  if (v != VK_SUCCESS) {
+    return explainVkResult("vkResetFences", v);
+  }
+  shard.clean.insert(shard.clean.end(), shard.dirty.begin(),
+                     shard.dirty.end());
+  shard.dirty.clear();
+  return 0;
+}
+
 std::shared_ptr<Fence> CommandPool::borrowFence() {
-  if (freeFences.empty()) {
-    static constexpr size_t borrowFenceChunkSize = 2;
-    while (freeFences.size() < borrowFenceChunkSize) {
-      auto f = std::make_shared<Fence>(vk.dev);
-      if (f->ctorError()) {
-        logE("CommandPool::borrowFence: fence[%zu].ctorError failed\n",
-             freeFences.size());
+  size_t first = getFenceShard();
+  std::shared_ptr<Fence> f;
+  // Try this thread's shard first, then take from the others.
+  for (size_t i = 0; i < fenceShardCount && !f; i++) {
+    auto& shard = fenceShards[(first + i) % fenceShardCount];
+    std::lock_guard<std::mutex> lock(shard.lockmutex);
+    if (shard.clean.empty() && resetDirty(shard)) {
+      logE("CommandPool::borrowFence: resetDirty failed\n");
+      return std::shared_ptr<Fence>();
+    }
+    if (!shard.clean.empty()) {
+      f = shard.clean.back();
+      shard.clean.pop_back();
+    }
+  }
+
+  if (!f) {
+    // Create enough fences to cover the peak number borrowed at once.
+    static constexpr size_t minChunk = 2, maxChunk = 64;
+    size_t chunk = std::min(maxChunk, std::max(minChunk, fencesPeak.load()));
+    std::vector<std::shared_ptr<Fence>> made;
+    for (size_t i = 0; i < chunk; i++) {
+      made.emplace_back(std::make_shared<Fence>(vk.dev));
+      if (made.back()->ctorError()) {
+        logE("CommandPool::borrowFence: fence[%zu].ctorError failed\n", i);
         return std::shared_ptr<Fence>();
       }
-      freeFences.emplace_back(f);
     }
+    f = made.back();
+    made.pop_back();
+    auto& shard = fenceShards[first];
+    std::lock_guard<std::mutex> lock(shard.lockmutex);
+    shard.clean.insert(shard.clean.end(), made.begin(), made.end());
+  }
+
+  size_t n = ++fencesBorrowed;
+  size_t peak = fencesPeak.load();
+  while (n > peak && !fencesPeak.compare_exchange_weak(peak, n)) {
   }
-  auto f = freeFences.back();
-  freeFences.pop_back();
   return f;
 }
 
@@ -217,11 +514,14 @@ int CommandPool::unborrowFence(std::shared_ptr<Fence> fence) {
     logE("unborrowFence: shared_ptr is NULL\n");
     return 1;
   }
-  if (fence->reset()) {
-    logE("unborrowFence: fence.reset failed\n");
+  fencesBorrowed--;
+  auto& shard = fenceShards[getFenceShard()];
+  std::lock_guard<std::mutex> lock(shard.lockmutex);
+  shard.dirty.emplace_back(fence);
+  if (shard.dirty.size() >= fenceResetBatch && resetDirty(shard)) {
+    logE("unborrowFence: resetDirty failed\n");
     return 1;
   }
-  freeFences.push_back(fence);
   return 0;
 }
 
@@ -25,9 +25,17 @@
 
 #include <src/language/language.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 // "command_builder.h" is #included at the end of the file (see below).
 
 #pragma once
@@ -42,6 +50,7 @@ namespace command {
 //    auto shader = std::make_shared<command::Shader>(dev);
 // 2. Load the SPIR-V code from a file (or somewhere else):
 //    if (shader->loadSPV("filename.spv")) { ... }
+//    (mapSPV avoids copying the file, and ShaderCache reuses a Shader.)
 // 3. Call PipelineCreateInfo::addShader(shader, ...), which will also add the
 //    shader to the RenderPass.
 //
@@ -79,6 +88,32 @@ typedef struct Shader {
     return loadSPV(filename.c_str());
   }
 
+  // mapSPV loads len bytes at offset in file without copying them into
+  // bytes: the Shader keeps a reference to file, and code() points into it.
+  // Use this with a pack of many shaders mapped once. If len is 0, the rest
+  // of file is used.
+  WARN_UNUSED_RESULT int mapSPV(std::shared_ptr<MMapFile> file, size_t offset,
+                                size_t len = 0);
+  // mapSPV memory-maps filename and calls mapSPV on it.
+  WARN_UNUSED_RESULT int mapSPV(const char* filename);
+  // mapSPV memory-maps filename and calls mapSPV on it.
+  WARN_UNUSED_RESULT int mapSPV(std::string filename) {
+    return mapSPV(filename.c_str());
+  }
+
+  // code returns the SPIR-V words from either bytes or mapping, or NULL if
+  // neither is set.
+  const uint32_t* code() const {
+    if (mapping) {
+      return mapped;
+    }
+    return bytes.empty() ? nullptr : bytes.data();
+  }
+  // codeLen returns the length of code() in bytes (not words).
+  size_t codeLen() const {
+    return mapping ? mappedLen : bytes.size() * sizeof(bytes.at(0));
+  }
+
   // setName forwards the setName call to vk.
   WARN_UNUSED_RESULT int setName(const std::string& name) {
     return vk.setName(name);
@@ -86,14 +121,104 @@ typedef struct Shader {
   // getName forwards the getName call to vk.
   const std::string& getName() const { return vk.getName(); }
 
+  // releaseBytes frees bytes and mapping. Only call it after all reflection
+  // is done (such as science::ShaderLibrary::add()).
+  void releaseBytes() {
+    std::vector<uint32_t>().swap(bytes);
+    mapping.reset();
+    mapped = nullptr;
+    mappedLen = 0;
+  }
+
   // vk is the underlying raw Vulkan Shader Module object.
   VkDebugPtr<VkShaderModule> vk;
   // bytes are the raw uint32_t's of the compiled shader. Vulkan itself does
   // not need your app to store these bytes on the CPU, but spirv_cross
-  // reflection is done on the CPU and needs them.
+  // reflection is done on the CPU and needs them. bytes is empty after
+  // mapSPV: use code() and codeLen() to read either one.
   std::vector<uint32_t> bytes;
+  // mapping is set by mapSPV instead of bytes. It keeps the file mapped.
+  std::shared_ptr<MMapFile> mapping;
+
+ protected:
+  // createModule calls vkCreateShaderModule.
+  WARN_UNUSED_RESULT int createModule(const uint32_t* spv, size_t len);
+
+  // mapped points into mapping.
+  const uint32_t* mapped{nullptr};
+  // mappedLen is the length of mapped in bytes.
+  size_t mappedLen{0};
 } Shader;
 
+// ShaderCache de-duplicates Shaders by the contents of their SPIR-V. Create
+// one ShaderCache for the Device and load all shaders through it: loading
+// the same SPIR-V twice (even from two different files, or for two different
+// RenderPasses) returns the same Shader and VkShaderModule.
+//
+// The cache does not keep a Shader alive. Once your app drops every
+// reference to a Shader, the next load() creates it again.
+typedef struct ShaderCache {
+  ShaderCache(language::Device& dev) : dev(dev) {}
+  ShaderCache(ShaderCache&&) = delete;
+  ShaderCache(const ShaderCache&) = delete;
+
+  language::Device& dev;
+
+  // load sets out to a Shader with the len bytes of SPIR-V at spv. If an
+  // identical Shader is cached it is reused, otherwise Shader::loadSPV is
+  // called.
+  WARN_UNUSED_RESULT int load(const uint32_t* spv, size_t len,
+                              std::shared_ptr<Shader>& out);
+  // load is a convenience method for loading from a std::vector.
+  WARN_UNUSED_RESULT int load(const std::vector<uint32_t>& spv,
+                              std::shared_ptr<Shader>& out) {
+    return load(spv.data(), spv.size() * sizeof(spv.at(0)), out);
+  }
+  // load is a convenience method for loading from a file. The file is
+  // loaded with Shader::mapSPV, so it is not copied.
+  WARN_UNUSED_RESULT int load(const char* filename,
+                              std::shared_ptr<Shader>& out);
+  // load loads len bytes at offset in file (such as a pack of many shaders)
+  // with Shader::mapSPV. If len is 0, the rest of file is used.
+  WARN_UNUSED_RESULT int load(std::shared_ptr<MMapFile> file, size_t offset,
+                              size_t len, std::shared_ptr<Shader>& out);
+  // load is a convenience method for loading from a file.
+  WARN_UNUSED_RESULT int load(std::string filename,
+                              std::shared_ptr<Shader>& out) {
+    return load(filename.c_str(), out);
+  }
+
+  // releaseBytes calls Shader::releaseBytes on every cached Shader. This is
+  // opt-in: only call it after all reflection is done. Shaders loaded later
+  // keep their bytes until releaseBytes is called again. A Shader without
+  // bytes is matched by its length and two different 64-bit hashes, since
+  // its SPIR-V can no longer be compared. Neither hash is cryptographic, so
+  // do not release bytes if shaders can come from an untrusted source.
+  void releaseBytes();
+
+  // hits counts the load() calls that reused a cached Shader.
+  uint64_t hits{0};
+  // misses counts the load() calls that created a new Shader.
+  uint64_t misses{0};
+
+ protected:
+  struct Entry {
+    std::weak_ptr<Shader> shader;
+    size_t len;
+    // check is a second hash of the SPIR-V that does not use hashBytes. It
+    // is compared instead of the bytes once they are released.
+    uint64_t check;
+  };
+  // loadOrMap implements load. If file is not NULL, spv points into it.
+  WARN_UNUSED_RESULT int loadOrMap(const uint32_t* spv, size_t len,
+                                   std::shared_ptr<MMapFile> file,
+                                   std::shared_ptr<Shader>& out);
+
+  std::mutex lockmutex;
+  // shaders is keyed by language::hashBytes() of the SPIR-V.
+  std::multimap<uint64_t, Entry> shaders;
+} ShaderCache;
+
 // PipelineAttachment constructs a VkAttachmentDescription2KHR. When it is
 // added to the VkRenderPassCreateInfo2KHR in RenderPass::ctorError(), it is
 // given an index -- written to VkAttachmentReference2KHR refvk here. The refvk
@@ -334,6 +459,26 @@ typedef struct Pipeline {
   VkDebugPtr<VkPipelineLayout> pipelineLayout;
   // vk is the raw VkPipeline.
   VkDebugPtr<VkPipeline> vk;
+  // generation is incremented each time vk is created. A new vk can reuse
+  // the handle value of an old one, but never its generation.
+  uint64_t generation{0};
+
+  // basePipe makes this a pipeline derivative of basePipe, which must have
+  // VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT in its info.flags. If basePipe
+  // is created in the same RenderPass::ctorError() and comes first, it is
+  // referenced by index; otherwise basePipe->vk must already exist. If
+  // neither is true, this pipeline is created as a normal pipeline. This
+  // applies to compute pipelines too.
+  //
+  // basePipe is a weak_ptr: Vulkan only reads the base while this pipeline
+  // is created, and a strong reference would keep every swapped-out pipeline
+  // alive in a chain of derivatives. If the base is gone, this pipeline is
+  // created as a normal pipeline.
+  //
+  // If any pipeline in a RenderPass has basePipe, RenderPass::ctorError()
+  // ignores maxThreads and creates them all with one call. PipelineBatch
+  // does the same if a basePipe is in the batch.
+  std::weak_ptr<Pipeline> basePipe;
 
   // setName forwards the setName call to vk.
   WARN_UNUSED_RESULT int setName(const std::string& name) {
@@ -400,6 +545,25 @@ typedef struct Pipeline {
   // Workaround bug in NVidia driver that driver does not keep a copy of the
   // VkPipelineShaderStageCreateInfo pName contents, just the pointer.
   std::vector<std::string> stageName;
+
+  // vkFlags is the VkPipelineCreateFlags that vk was created with.
+  VkPipelineCreateFlags vkFlags{0};
+
+  // CreateInfoStorage holds the structs that a VkGraphicsPipelineCreateInfo
+  // points to. It must not move until vkCreateGraphicsPipelines returns.
+  struct CreateInfoStorage {
+    std::vector<VkPipelineShaderStageCreateInfo> stages;
+    std::vector<VkSpecializationInfo> specInfo;
+    std::vector<VkDynamicState> dynamicStates;
+    VkPipelineDynamicStateCreateInfo dsci;
+  };
+
+  // makeCreateInfo creates pipelineLayout and fills in p, ready for
+  // vkCreateGraphicsPipelines.
+  WARN_UNUSED_RESULT int makeCreateInfo(RenderPass& pass, size_t subpass_i,
+                                        CreateInfoStorage& storage,
+                                        VkGraphicsPipelineCreateInfo& p);
+  friend struct RenderPass;
 } Pipeline;
 
 // RenderPass generates pixels for the screen or somewhere else. It
@@ -438,8 +602,16 @@ typedef struct RenderPass {
       size_t subpass_i, VkSubpassDependency2KHR& dep) const;
 
   // ctorError() initializes each pipeline with their PipelineCreateInfo info.
+  // By default all the pipelines are created in a single call to
+  // vkCreateGraphicsPipelines, so the driver can share work between them.
   WARN_UNUSED_RESULT int ctorError();
 
+  // maxThreads > 1 makes ctorError() instead create each pipeline with its
+  // own vkCreateGraphicsPipelines call, using up to maxThreads threads. The
+  // default, 0, and 1 both use one batched call on the calling thread, as
+  // does any RenderPass with a Pipeline::basePipe.
+  size_t maxThreads{0};
+
   // setName forwards the setName call to vk.
   WARN_UNUSED_RESULT int setName(const std::string& name) {
     return vk.setName(name);
@@ -519,8 +691,252 @@ typedef struct RenderPass {
   std::shared_ptr<memory::Image> image;
   std::shared_ptr<language::Framebuf> imageFramebuf;
   friend class CommandPool;
+
+  // ctorPipelines creates all pipelines with one vkCreateGraphicsPipelines.
+  WARN_UNUSED_RESULT int ctorPipelines();
 } RenderPass;
 
+// PipelineBatch builds compute Pipelines in parallel. Pipeline creation is
+// CPU-bound and each pipeline is independent, so the work is split across a
+// pool of threads that all share dev.pipelineCache (a VkPipelineCache is
+// internally synchronized unless created with
+// VK_PIPELINE_CACHE_CREATE_EXTERNALLY_SYNCHRONIZED_BIT_EXT).
+//
+// Use PipelineBatch like this:
+//   PipelineBatch batch(cpool);
+//   batch.pipelines.emplace_back(std::make_shared<Pipeline>(cpool, shader));
+//   ... customize each Pipeline::info ...
+//   if (batch.ctorError()) { ... handle errors ... }
+typedef struct PipelineBatch {
+  PipelineBatch(CommandPool& computeCommandPool) : cpool(computeCommandPool) {}
+
+  // cpool is passed to Pipeline::ctorError(CommandPool&).
+  CommandPool& cpool;
+
+  // pipelines are all built by ctorError(). They must be compute pipelines.
+  std::vector<std::shared_ptr<Pipeline>> pipelines;
+
+  // maxThreads limits how many threads ctorError() uses. The default, 0, uses
+  // std::thread::hardware_concurrency(). If a Pipeline's basePipe is also in
+  // pipelines, ctorError() uses only the calling thread, in order, so put
+  // base pipelines first.
+  size_t maxThreads{0};
+
+  // ctorError() calls Pipeline::ctorError on every Pipeline in pipelines.
+  // All pipelines are attempted even if one fails, and each failure is
+  // logged.
+  WARN_UNUSED_RESULT int ctorError();
+
+  // forEach calls fn(i) for each i in [0, n) using up to maxThreads threads,
+  // including the calling thread. The order fn is called in is undefined. If
+  // fn returns non-zero, fn's index is added to failed, which is sorted
+  // before forEach returns. forEach returns 1 if failed is not empty.
+  WARN_UNUSED_RESULT static int forEach(size_t n, size_t maxThreads,
+                                        std::function<int(size_t)> fn,
+                                        std::vector<size_t>& failed);
+} PipelineBatch;
+
+// AsyncPipeline builds a Pipeline on a background thread so the calling
+// thread (usually the render thread) does not block. Poll isReady() each
+// frame, and use get() to pick the Pipeline to bind: get() returns fallback
+// until pipe is ready.
+//
+// pipe must not be in use while it is being built, because its ctorError()
+// destroys and recreates pipe->vk. To hot-swap a Pipeline, build a new one
+// (see science::PipeBuilder::ctorErrorAsync) and keep the old one as the
+// fallback.
+typedef struct AsyncPipeline {
+  AsyncPipeline(std::shared_ptr<Pipeline> pipe,
+                std::shared_ptr<Pipeline> fallback = nullptr)
+      : pipe(pipe), fallback(fallback) {}
+  AsyncPipeline(AsyncPipeline&&) = default;
+  AsyncPipeline(const AsyncPipeline&) = delete;
+  // The destructor waits for the background thread to finish.
+  virtual ~AsyncPipeline();
+
+  // pipe is the Pipeline being built.
+  std::shared_ptr<Pipeline> pipe;
+  // fallback is optional. It is returned by get() until pipe is ready.
+  std::shared_ptr<Pipeline> fallback;
+
+  // ctorError starts building a graphics pipeline by calling
+  // pipe->ctorError(pass, subpass_i) on a background thread. pass must not
+  // be destroyed or have pipelines added or removed until isReady().
+  WARN_UNUSED_RESULT int ctorError(RenderPass& pass, size_t subpass_i);
+
+  // ctorError starts building a compute pipeline by calling
+  // pipe->ctorError(computeCommandPool) on a background thread.
+  WARN_UNUSED_RESULT int ctorError(CommandPool& computeCommandPool);
+
+  // isReady returns true when the background thread has finished. Check
+  // isFailed() to see if it succeeded.
+  bool isReady();
+
+  // isFailed returns true if pipe->ctorError failed. It blocks if !isReady().
+  bool isFailed();
+
+  // wait blocks until the background thread finishes, then returns the
+  // result of pipe->ctorError.
+  WARN_UNUSED_RESULT int wait();
+
+  // get returns pipe if it is ready and did not fail. Otherwise it returns
+  // fallback, which may be NULL.
+  std::shared_ptr<Pipeline> get() {
+    if (isReady() && !isFailed()) {
+      return pipe;
+    }
+    return fallback;
+  }
+
+ protected:
+  std::future<int> result;
+  // started is set by ctorError.
+  bool started{false};
+  // status is the result of pipe->ctorError once result has been read.
+  int status{0};
+} AsyncPipeline;
+
+// PipelineVariants caches copies of a base Pipeline that only differ in their
+// specialization constants, such as several tuned versions of one compute
+// kernel. Each variant is keyed by the base Pipeline and a hash of the
+// specialization, so asking for the same variant again returns the Pipeline
+// that was already built.
+//
+// Variants are built through dev.pipelineCache, and each one sets basePipe to
+// the base Pipeline so drivers can treat it as a pipeline derivative (if the
+// base has VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT). A hash collision
+// between two different specializations is detected and returns an error.
+//
+// The spec argument is a struct generated by the glslangValidator rule that
+// runs copy_header, the same as PipelineCreateInfo::specialize().
+typedef struct PipelineVariants {
+  PipelineVariants() {}
+  PipelineVariants(PipelineVariants&&) = delete;
+  PipelineVariants(const PipelineVariants&) = delete;
+  // The destructor calls clear().
+  virtual ~PipelineVariants() { clear(); }
+
+  // get sets out to the variant of the compute Pipeline base using spec. If
+  // it does not exist yet, get blocks until it is built.
+  template <typename T>
+  WARN_UNUSED_RESULT int get(CommandPool& computeCommandPool,
+                             std::shared_ptr<Pipeline> base, T& spec,
+                             std::shared_ptr<Pipeline>& out) {
+    Spec s;
+    if (s.set(spec)) {
+      return 1;
+    }
+    return getVariant(&computeCommandPool, nullptr, 0, base, s, false, out);
+  }
+
+  // get sets out to the variant of the graphics Pipeline base, which is
+  // compatible with subpass_i of pass.
+  template <typename T>
+  WARN_UNUSED_RESULT int get(RenderPass& pass, size_t subpass_i,
+                             std::shared_ptr<Pipeline> base, T& spec,
+                             std::shared_ptr<Pipeline>& out) {
+    Spec s;
+    if (s.set(spec)) {
+      return 1;
+    }
+    return getVariant(nullptr, &pass, subpass_i, base, s, false, out);
+  }
+
+  // getAsync is like get, but builds the variant on a background thread.
+  // out is set to base until the variant is ready, so call getAsync every
+  // frame and use whatever it returns. If the variant fails to build, the
+  // error is logged once and out stays set to base.
+  //
+  // Variants are never built while lockmutex is held, so getAsync does not
+  // block behind a get() that is building a different variant.
+  template <typename T>
+  WARN_UNUSED_RESULT int getAsync(CommandPool& computeCommandPool,
+                                  std::shared_ptr<Pipeline> base, T& spec,
+                                  std::shared_ptr<Pipeline>& out) {
+    Spec s;
+    if (s.set(spec)) {
+      return 1;
+    }
+    return getVariant(&computeCommandPool, nullptr, 0, base, s, true, out);
+  }
+
+  // getAsync for a graphics Pipeline. pass must not be destroyed or have
+  // pipelines added or removed while the variant is being built.
+  template <typename T>
+  WARN_UNUSED_RESULT int getAsync(RenderPass& pass, size_t subpass_i,
+                                  std::shared_ptr<Pipeline> base, T& spec,
+                                  std::shared_ptr<Pipeline>& out) {
+    Spec s;
+    if (s.set(spec)) {
+      return 1;
+    }
+    return getVariant(nullptr, &pass, subpass_i, base, s, true, out);
+  }
+
+  // size returns the number of variants, including those still being built.
+  size_t size() {
+    std::lock_guard<std::mutex> lock(lockmutex);
+    return variants.size();
+  }
+
+  // clear removes all variants. It waits for any that are being built.
+  void clear();
+
+ protected:
+  // Spec is the result of T::getMap() plus its hash.
+  struct Spec {
+    std::vector<VkSpecializationMapEntry> map;
+    VkSpecializationInfo info;
+    VkShaderStageFlags flags;
+    uint64_t hash;
+
+    template <typename T>
+    WARN_UNUSED_RESULT int set(T& spec) {
+      if (spec.getMap(map, info, flags)) {
+        logE("PipelineVariants: getMap failed\n");
+        return 1;
+      }
+      hash = language::hashBytes(&flags, sizeof(flags));
+      hash = language::hashBytes(map.data(), map.size() * sizeof(map.at(0)),
+                                 hash);
+      hash = language::hashBytes(info.pData, info.dataSize, hash);
+      return 0;
+    }
+  };
+
+  struct Variant {
+    // base is held so its address (part of the key) is not reused.
+    std::shared_ptr<Pipeline> base;
+    // flags, map and data are a copy of the Spec, to detect hash collisions.
+    VkShaderStageFlags flags{0};
+    std::vector<VkSpecializationMapEntry> map;
+    std::vector<char> data;
+    std::shared_ptr<Pipeline> pipe;
+    // building is true until pipe->ctorError returns. Then failed is set if
+    // it failed. Both are protected by lockmutex.
+    bool building{true};
+    bool failed{false};
+    // reported is set after a failed getAsync has been logged.
+    bool reported{false};
+    // result holds the background thread building pipe.
+    std::future<void> result;
+
+    // matches returns true if s is the same Spec this Variant was built with.
+    bool matches(const Spec& s) const;
+  };
+
+  WARN_UNUSED_RESULT int getVariant(CommandPool* cpool, RenderPass* pass,
+                                    size_t subpass_i,
+                                    std::shared_ptr<Pipeline> base,
+                                    const Spec& s, bool isAsync,
+                                    std::shared_ptr<Pipeline>& out);
+
+  std::mutex lockmutex;
+  // built is notified each time a Variant finishes building.
+  std::condition_variable built;
+  std::map<std::pair<Pipeline*, uint64_t>, std::shared_ptr<Variant>> variants;
+} PipelineVariants;
+
 }  // namespace command
 
 // Some classes are split out of command.h just to break things up a little:
@@ -24,7 +24,22 @@ typedef struct SubmitInfo {
   std::vector<VkCommandBuffer> cmdBuffers;
   // toSignal contains a vector of semaphores that will be signalled
   // when the batch completes. (Semaphores can release other GPU work to run.)
+  // Add a timeline semaphore with signal(), not directly to toSignal.
   std::vector<VkSemaphore> toSignal;
+  // signalValues holds the value to signal for each timeline semaphore in
+  // toSignal, in the same order. It may be left empty if toSignal has no
+  // timeline semaphores. (The value for a binary semaphore is ignored.)
+  // CommandPool::submit() only passes values to the device if signalValues
+  // is not empty or a waitFor entry has timeline set.
+  std::vector<uint64_t> signalValues;
+
+  // signal is a convenience to add sem to toSignal with value. It always
+  // fills in signalValues, so it also works when value is 0.
+  void signal(VkSemaphore sem, uint64_t value) {
+    signalValues.resize(toSignal.size(), 0);
+    toSignal.emplace_back(sem);
+    signalValues.emplace_back(value);
+  }
 } SubmitInfo;
 
 // Forward declaration of CommandBuffer for CommandPool.
@@ -50,7 +65,30 @@ class CommandPool {
   VkCommandBuffer toBorrow{VK_NULL_HANDLE};
   int borrowCount{0};
   friend class CommandBuffer;
-  std::vector<std::shared_ptr<Fence>> freeFences;
+
+  // FenceShard is one free list of fences. borrowFence and unborrowFence
+  // start at the shard picked by the calling thread's id, so threads rarely
+  // contend for the same mutex and a fence tends to go back to the thread
+  // that used it last.
+  struct FenceShard {
+    std::mutex lockmutex;
+    // clean fences are unsignalled and ready to be borrowed.
+    std::vector<std::shared_ptr<Fence>> clean;
+    // dirty fences were unborrowed but have not been reset yet.
+    std::vector<std::shared_ptr<Fence>> dirty;
+  };
+  static constexpr size_t fenceShardCount = 8;
+  FenceShard fenceShards[fenceShardCount];
+  // fencesBorrowed is the number of fences currently borrowed.
+  std::atomic<size_t> fencesBorrowed{0};
+  // fencesPeak is the highest fencesBorrowed has been.
+  std::atomic<size_t> fencesPeak{0};
+
+  // getFenceShard returns the index of the calling thread's shard.
+  size_t getFenceShard() const;
+  // resetDirty resets all of shard.dirty with one vkResetFences and moves
+  // them to shard.clean. The caller must hold shard.lockmutex.
+  WARN_UNUSED_RESULT int resetDirty(FenceShard& shard);
 
  public:
   CommandPool(language::Device& dev)
@@ -137,14 +175,20 @@ class CommandPool {
   int unborrowOneTimeBuffer(VkCommandBuffer buf);
 
   // borrowFence returns an unsignalled Fence. If all fences are in use,
-  // borrowFence allocates more.
-  // TODO: potential optimization to use thread id to give fences a loose
-  //       affinity to the thread that used them last.
+  // borrowFence allocates more: as many as were ever borrowed at once.
+  //
+  // borrowFence and unborrowFence are thread-safe and do not need lockmutex.
   std::shared_ptr<Fence> borrowFence();
 
   // unborrowFence puts the Fence back into a pool of available fences.
+  // Fences are reset in batches of fenceResetBatch, so an error from
+  // vkResetFences may be reported by a later call.
   WARN_UNUSED_RESULT int unborrowFence(std::shared_ptr<Fence> fence);
 
+  // fenceResetBatch is how many fences unborrowFence collects before
+  // resetting them all with one call to vkResetFences.
+  size_t fenceResetBatch{8};
+
   // reallocCmdBufs is a convenience method that resizes any type as long as it
   // works like std::vector (has .size(), .at(), .emplace_back()) and its
   // element type returned by .at() has a .vk member of type VkCommandBuffer.
@@ -254,6 +298,87 @@ class CommandPool {
   VkDebugPtr<VkCommandPool> vk;
 };
 
+// SubmitThread runs a thread that calls CommandPool::submit for other
+// threads. Producers call enqueue() instead of taking cpool.lockmutex and
+// calling vkQueueSubmit themselves. The thread collects everything enqueued
+// since its last submit and passes it to as few vkQueueSubmit calls as
+// possible: vkQueueSubmit takes only one fence, so each SubmitInfo enqueued
+// with a fence ends a batch.
+//
+// To signal a timeline semaphore instead of a fence, use SubmitInfo::signal.
+typedef struct SubmitThread {
+  SubmitThread(CommandPool& cpool, size_t poolQindex)
+      : cpool(cpool), poolQindex(poolQindex) {}
+  SubmitThread(SubmitThread&&) = delete;
+  SubmitThread(const SubmitThread&) = delete;
+  // The destructor calls stop().
+  virtual ~SubmitThread();
+
+  // Two-stage constructor: call ctorError() to start the thread.
+  WARN_UNUSED_RESULT int ctorError();
+
+  // stop submits everything still enqueued, then stops the thread.
+  void stop();
+
+  // enqueue adds info to the queue. If fence is not VK_NULL_HANDLE, it is
+  // signalled when info (and everything enqueued before it) completes.
+  WARN_UNUSED_RESULT int enqueue(SubmitInfo info,
+                                 VkFence fence = VK_NULL_HANDLE);
+
+  // flush waits until everything enqueued so far has been submitted. It
+  // returns non-zero if any submit failed since the last flush.
+  WARN_UNUSED_RESULT int flush();
+
+  // Stats measures how well SubmitThread is coalescing submits.
+  typedef struct Stats {
+    // submits is the number of calls to vkQueueSubmit.
+    uint64_t submits{0};
+    // infos is the number of SubmitInfo submitted.
+    uint64_t infos{0};
+    // maxBatch is the most SubmitInfo passed to one vkQueueSubmit.
+    size_t maxBatch{0};
+    // latencyNs is the total time from enqueue until vkQueueSubmit returned.
+    uint64_t latencyNs{0};
+    // maxLatencyNs is the longest time for a single SubmitInfo.
+    uint64_t maxLatencyNs{0};
+
+    double avgBatch() const { return submits ? double(infos) / submits : 0; }
+    double avgLatencyNs() const {
+      return infos ? double(latencyNs) / infos : 0;
+    }
+  } Stats;
+
+  // getStats returns a copy of the stats.
+  Stats getStats();
+  // resetStats sets all the stats back to 0.
+  void resetStats();
+
+  CommandPool& cpool;
+  const size_t poolQindex;
+
+ protected:
+  typedef std::chrono::steady_clock clock;
+  struct Item {
+    SubmitInfo info;
+    VkFence fence;
+    clock::time_point t;
+  };
+
+  void threadMain();
+  // submitAll submits all of work and adds to s.
+  WARN_UNUSED_RESULT int submitAll(std::vector<Item>& work, Stats& s);
+
+  std::mutex lockmutex;
+  std::condition_variable wake;
+  std::condition_variable idle;
+  std::vector<Item> pending;
+  bool quit{false};
+  bool busy{false};
+  int failed{0};
+  Stats stats;
+  std::thread thread;
+} SubmitThread;
+
 // CommandBuffer holds a VkCommandBuffer, and provides helpful utility methods
 // to create commands in the buffer.
 //
@@ -264,6 +389,10 @@ class CommandPool {
 // CommandBuffer::vk is not a VkPtr<> or VkDebugPtr<> because VkCommandPool and
 // VkCommandBuffer are managed together. See command.cpp.
 class CommandBuffer {
+ public:
+  // Forward declaration of BarrierSet, which is defined below.
+  struct BarrierSet;
+
  protected:
   // trimSrcStage modifies access bits that are not supported by stage. It also
   // simplifies stage selection by tailoring the stage to the access bits'
@@ -273,6 +402,16 @@ class CommandBuffer {
   // trimDstStage modifies access bits that are not supported by stage.
   void trimDstStage(VkAccessFlags& access, VkPipelineStageFlags& stage);
 
+  // mergeLazyBarriers is called by validateLazyBarriers to merge duplicate
+  // barriers, collapse layout transitions A->B->C into A->C, and drop
+  // barriers that do nothing. It adds the number removed to barriersElided.
+  void mergeLazyBarriers();
+
+  // trimBarrierStages validates the barriers in b and narrows b.srcStageMask
+  // and b.dstStageMask using trimSrcStage and trimDstStage. It returns 2 if b
+  // is empty.
+  WARN_UNUSED_RESULT int trimBarrierStages(BarrierSet& b);
+
   // validateLazyBarriers is called by flushLazyBarriers.
   WARN_UNUSED_RESULT int validateLazyBarriers(CommandPool::lock_guard_t& lock);
 
@@ -288,6 +427,7 @@ class CommandBuffer {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
     vk = other.vk;
     other.vk = VK_NULL_HANDLE;
+    shadow = other.shadow;
   }
   // The copy constructor is not allowed. The VkCommandBuffer cannot be copied.
   CommandBuffer(const CommandBuffer& other) = delete;
@@ -300,6 +440,96 @@ class CommandBuffer {
   // vk is NULL until the VkCommandBuffer is actually allocated.
   VkCommandBuffer vk{VK_NULL_HANDLE};
 
+  // ShadowState remembers what is bound in this CommandBuffer so that calls
+  // which would change nothing can be skipped. Scene traversal code often
+  // binds the same state for every draw.
+  //
+  // Each redundant*() method returns true if the call can be skipped (and
+  // counts it in elided). Otherwise it records the new state and returns
+  // false. They always return false if isEnabled() is false.
+  struct ShadowState {
+    // elided counts how many calls were skipped.
+    uint64_t elided{0};
+
+    // setEnabled turns redundant state filtering on or off. It defaults to
+    // off. Nothing is recorded while it is off, so any change calls reset():
+    // it is safe to turn it on in the middle of recording.
+    void setEnabled(bool on) {
+      if (on != enabled) {
+        reset();
+      }
+      enabled = on;
+    }
+    bool isEnabled() const { return enabled; }
+
+    // reset forgets all state. It does not reset enabled or elided.
+    void reset();
+
+    bool redundantPipeline(VkPipelineBindPoint bindPoint, VkPipeline pipe);
+    bool redundantDescriptorSets(VkPipelineBindPoint bindPoint,
+                                 VkPipelineLayout layout, uint32_t firstSet,
+                                 uint32_t descriptorSetCount,
+                                 const VkDescriptorSet* pDescriptorSets,
+                                 uint32_t dynamicOffsetCount,
+                                 const uint32_t* pDynamicOffsets);
+    // forgetDescriptorSet is called when set is modified some other way, such
+    // as with vkCmdPushDescriptorSetKHR.
+    void forgetDescriptorSet(VkPipelineBindPoint bindPoint, uint32_t set);
+    bool redundantVertexBuffers(uint32_t firstBinding, uint32_t bindingCount,
+                                const VkBuffer* pBuffers,
+                                const VkDeviceSize* pOffsets);
+    bool redundantIndexBuffer(VkBuffer buf, VkDeviceSize offset,
+                              VkIndexType indexType);
+    bool redundantViewports(uint32_t first, uint32_t count,
+                            const VkViewport* pViewports);
+    bool redundantScissors(uint32_t first, uint32_t count,
+                           const VkRect2D* pScissors);
+    bool redundantLineWidth(float lineWidth);
+    bool redundantBlendConstants(const float blendConstants[4]);
+    bool redundantDepthBias(float constantFactor, float clamp,
+                            float slopeFactor);
+    bool redundantDepthBounds(float minBound, float maxBound);
+
+   protected:
+    bool enabled{false};
+
+    // resetDynamic forgets dynamic state, which a new pipeline may overwrite.
+    void resetDynamic();
+
+    // BoundSet holds one descriptor set binding.
+    struct BoundSet {
+      VkDescriptorSet ds{VK_NULL_HANDLE};
+      std::vector<uint32_t> dynamicOffsets;
+    };
+    // BindPointState holds state that is separate for each bind point.
+    struct BindPointState {
+      VkPipeline pipe{VK_NULL_HANDLE};
+      VkPipelineLayout layout{VK_NULL_HANDLE};
+      std::vector<BoundSet> sets;
+    };
+    // getBindPoint returns NULL for bind points that are not tracked.
+    BindPointState* getBindPoint(VkPipelineBindPoint bindPoint);
+    BindPointState graphics, compute;
+
+    std::vector<std::pair<VkBuffer, VkDeviceSize>> vertexBuffers;
+    VkBuffer indexBuf{VK_NULL_HANDLE};
+    VkDeviceSize indexOffset{0};
+    VkIndexType indexType{VK_INDEX_TYPE_UINT16};
+
+    std::vector<VkViewport> viewports;
+    std::vector<VkRect2D> scissors;
+    // floats holds lineWidth, blendConstants[4], depthBias[3], depthBounds[2]
+    // in that order. floatValid has one bit for each group.
+    float floats[10];
+    uint32_t floatValid{0};
+    bool redundantFloats(uint32_t bit, size_t first, size_t count,
+                         const float* values);
+  };
+
+  // shadow holds the ShadowState of this CommandBuffer. Call
+  // shadow.setEnabled(true) to turn it on.
+  ShadowState shadow;
+
   // enqueue adds this CommandBuffer to info.cmdBuffers.
   //
   // You must create a lock_guard_t lock(cpool.lockmutex) to protect
@@ -319,6 +549,7 @@ class CommandBuffer {
           VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
     if (flushLazyBarriers(lock)) return 1;
+    shadow.reset();
     VkResult v;
     if ((v = vkResetCommandBuffer(vk, flags)) != VK_SUCCESS) {
       return explainVkResult("vkResetCommandBuffer", v);
@@ -336,6 +567,7 @@ class CommandBuffer {
     cbbi.sType = autoSType(cbbi);
     cbbi.flags = usageFlags;
     cbbi.pInheritanceInfo = pInherits;
+    shadow.reset();
     VkResult v = vkBeginCommandBuffer(vk, &cbbi);
     if (v != VK_SUCCESS) {
       return explainVkResult("vkBeginCommandBuffer", v);
@@ -378,6 +610,8 @@ class CommandBuffer {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
     if (flushLazyBarriers(lock)) return 1;
     vkCmdExecuteCommands(vk, secondaryCmdsCount, pSecondaryCmds);
+    // The secondary command buffers leave the state undefined.
+    shadow.reset();
     return 0;
   }
 
@@ -644,6 +878,7 @@ class CommandBuffer {
   WARN_UNUSED_RESULT int bindPipeline(VkPipelineBindPoint bindPoint,
                                       Pipeline& pipe) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
+    if (shadow.redundantPipeline(bindPoint, pipe.vk)) return 0;
     if (flushLazyBarriers(lock)) return 1;
     vkCmdBindPipeline(vk, bindPoint, pipe.vk);
     return 0;
@@ -655,6 +890,11 @@ class CommandBuffer {
       uint32_t dynamicOffsetCount = 0,
       const uint32_t* pDynamicOffsets = nullptr) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
+    if (shadow.redundantDescriptorSets(bindPoint, layout, firstSet,
+                                       descriptorSetCount, pDescriptorSets,
+                                       dynamicOffsetCount, pDynamicOffsets)) {
+      return 0;
+    }
     if (flushLazyBarriers(lock)) return 1;
     vkCmdBindDescriptorSets(vk, bindPoint, layout, firstSet, descriptorSetCount,
                             pDescriptorSets, dynamicOffsetCount,
@@ -697,6 +937,10 @@ class CommandBuffer {
                                            const VkBuffer* pBuffers,
                                            const VkDeviceSize* pOffsets) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
+    if (shadow.redundantVertexBuffers(firstBinding, bindingCount, pBuffers,
+                                      pOffsets)) {
+      return 0;
+    }
     if (flushLazyBarriers(lock)) return 1;
     vkCmdBindVertexBuffers(vk, firstBinding, bindingCount, pBuffers, pOffsets);
     return 0;
@@ -705,6 +949,7 @@ class CommandBuffer {
   WARN_UNUSED_RESULT int bindIndexBuffer(VkBuffer indexBuf, VkDeviceSize offset,
                                          VkIndexType indexType) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
+    if (shadow.redundantIndexBuffer(indexBuf, offset, indexType)) return 0;
     if (flushLazyBarriers(lock)) return 1;
     vkCmdBindIndexBuffer(vk, indexBuf, offset, indexType);
     return 0;
@@ -857,6 +1102,10 @@ class CommandBuffer {
   };
   BarrierSet lazyBarriers;
 
+  // barriersElided counts the barriers in lazyBarriers that were merged into
+  // another barrier or dropped. Your app can read and reset it every frame.
+  uint64_t barriersElided{0};
+
   // waitBarrier calls vkCmdPipelineBarrier. This will flush previous barrier()
   // calls if they were used, but gives direct access to vkCmdPipelineBarrier.
   // The other forms of barrier() below lazily construct a BarrierSet which is
@@ -885,16 +1134,16 @@ class CommandBuffer {
   // barrier(Image, VkImageLayout) adds a barrier that transitions Image to
   // a new layout.
   //
-  // As a convenience this changes img.currentLayout to newLayout.
-  // WARNING: the other barrier() does NOT auto-update img.currentLayout!
+  // As a convenience this changes img.currentLayout to newLayout. If parts of
+  // img are in different layouts, only those not in newLayout get a barrier.
   WARN_UNUSED_RESULT int barrier(memory::Image& img, VkImageLayout newLayout);
 
-  // barrier(Image, VkImageLayout, VkImageSubresourceRange) adds a barrier that
-  // transitions the part of Image given by 'range' to a new layout.
+  // barrier(Image, VkImageLayout, VkImageSubresourceRange) adds barriers that
+  // transition the part of Image given by 'range' to a new layout.
   //
-  // WARNING: this does NOT auto-update img.currentLayout, since only a range
-  // within the image is being transitioned. The other barrier() method does
-  // auto-update img.currentLayout. Potential confusion alert!
+  // img tracks the layout of each mip level and array layer (see
+  // Image::getLayout), and only the ones not already in newLayout get a
+  // barrier. Each barrier uses the old layout of that part of img.
   WARN_UNUSED_RESULT int barrier(memory::Image& img, VkImageLayout newLayout,
                                  const VkImageSubresourceRange& range);
 
@@ -927,6 +1176,33 @@ class CommandBuffer {
     return 0;
   }
 
+  // splitBarrierSignal and splitBarrierWait split the barriers in b into two
+  // halves so that commands recorded in between are not blocked by them:
+  //
+  //   cmd.barrier(...) or build BarrierSet b
+  //   ... record the commands that produce the data ...
+  //   cmd.splitBarrierSignal(event, b);  // Calls vkCmdSetEvent.
+  //   ... record independent work ...
+  //   cmd.splitBarrierWait(event, b);    // Calls vkCmdWaitEvents.
+  //   ... record the commands that consume the data ...
+  //
+  // splitBarrierSignal computes b.srcStageMask and b.dstStageMask from the
+  // access masks (see trimSrcStage and trimDstStage), so leave them at their
+  // defaults unless your app knows better. Do not modify b between the two
+  // calls. event must have been created with Event::ctorError(), and must be
+  // used only within a single queue.
+  WARN_UNUSED_RESULT int splitBarrierSignal(Event& event, BarrierSet& b);
+
+  // splitBarrierWait waits for event and applies the barriers in b. It also
+  // resets event so it can be used again.
+  WARN_UNUSED_RESULT int splitBarrierWait(Event& event, BarrierSet& b);
+
+  // splitBarrier adds a transition of img to newLayout to b, to be used with
+  // splitBarrierSignal and splitBarrierWait. img.currentLayout is updated, so
+  // the commands recorded between the signal and the wait must not use img.
+  WARN_UNUSED_RESULT int splitBarrier(memory::Image& img,
+                                      VkImageLayout newLayout, BarrierSet& b);
+
   WARN_UNUSED_RESULT int setEvent(VkEvent event,
                                   VkPipelineStageFlags stageMask) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
@@ -958,6 +1234,7 @@ class CommandBuffer {
 
   WARN_UNUSED_RESULT int setBlendConstants(const float blendConstants[4]) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
+    if (shadow.redundantBlendConstants(blendConstants)) return 0;
     if (flushLazyBarriers(lock)) return 1;
     vkCmdSetBlendConstants(vk, blendConstants);
     return 0;
@@ -965,18 +1242,23 @@ class CommandBuffer {
   WARN_UNUSED_RESULT int setDepthBias(float constantFactor, float clamp,
                                       float slopeFactor) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
+    if (shadow.redundantDepthBias(constantFactor, clamp, slopeFactor)) {
+      return 0;
+    }
     if (flushLazyBarriers(lock)) return 1;
     vkCmdSetDepthBias(vk, constantFactor, clamp, slopeFactor);
     return 0;
   }
   WARN_UNUSED_RESULT int setDepthBounds(float minBound, float maxBound) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
+    if (shadow.redundantDepthBounds(minBound, maxBound)) return 0;
     if (flushLazyBarriers(lock)) return 1;
     vkCmdSetDepthBounds(vk, minBound, maxBound);
     return 0;
   }
   WARN_UNUSED_RESULT int setLineWidth(float lineWidth) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
+    if (shadow.redundantLineWidth(lineWidth)) return 0;
     if (flushLazyBarriers(lock)) return 1;
     vkCmdSetLineWidth(vk, lineWidth);
     return 0;
@@ -985,6 +1267,9 @@ class CommandBuffer {
                                     uint32_t scissorCount,
                                     const VkRect2D* pScissors) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
+    if (shadow.redundantScissors(firstScissor, scissorCount, pScissors)) {
+      return 0;
+    }
     if (flushLazyBarriers(lock)) return 1;
     vkCmdSetScissor(vk, firstScissor, scissorCount, pScissors);
     return 0;
@@ -1014,10 +1299,31 @@ class CommandBuffer {
                                      uint32_t viewportCount,
                                      const VkViewport* pViewports) {
     CommandPool::lock_guard_t lock(cpool.lockmutex);
+    if (shadow.redundantViewports(firstViewport, viewportCount, pViewports)) {
+      return 0;
+    }
     if (flushLazyBarriers(lock)) return 1;
     vkCmdSetViewport(vk, firstViewport, viewportCount, pViewports);
     return 0;
   }
+  // setViewportAndScissor sets viewport 0 and scissor 0 to all of extent, for
+  // a pipeline with VK_DYNAMIC_STATE_VIEWPORT and VK_DYNAMIC_STATE_SCISSOR.
+  // Call it with the framebuf size each time the command buffer is recorded.
+  WARN_UNUSED_RESULT int setViewportAndScissor(VkExtent2D extent) {
+    VkViewport viewport{
+        /*x:*/ 0.0f,
+        /*y:*/ 0.0f,
+        /*width:*/ (float)extent.width,
+        /*height:*/ (float)extent.height,
+        /*minDepth:*/ 0.0f,
+        /*maxDepth:*/ 1.0f,
+    };
+    VkRect2D scissor{
+        /*offset:*/ {0, 0},
+        /*extent:*/ extent,
+    };
+    return setViewport(0, 1, &viewport) || setScissor(0, 1, &scissor);
+  }
 #if defined(VK_VERSION_1_1) && !defined(__ANDROID__)
   // setDeviceMask comes from vkCmdSetDeviceMaskKHR in VK_KHR_device_group but
   // was promoted to core in Vulkan 1.1.
@@ -1039,6 +1345,7 @@ class CommandBuffer {
     }
     CommandPool::lock_guard_t lock(cpool.lockmutex);
     if (flushLazyBarriers(lock)) return 1;
+    shadow.forgetDescriptorSet(pipelineBindPoint, set);
     cpool.fp.pushDescriptorSet(vk, pipelineBindPoint, layout, set,
                                descriptorWriteCount, pDescriptorWrites);
     return 0;
@@ -1054,6 +1361,9 @@ class CommandBuffer {
     }
     CommandPool::lock_guard_t lock(cpool.lockmutex);
     if (flushLazyBarriers(lock)) return 1;
+    // The template's bind point is not known here, so forget both.
+    shadow.forgetDescriptorSet(VK_PIPELINE_BIND_POINT_GRAPHICS, set);
+    shadow.forgetDescriptorSet(VK_PIPELINE_BIND_POINT_COMPUTE, set);
     cpool.fp.pushDescriptorSetWithTemplate(vk, descriptorUpdateTemplate, layout,
                                            set, pData);
     return 0;
@@ -76,7 +76,14 @@ int Pipeline::ctorError(CommandPool& computeCommandPool) {
   VkComputePipelineCreateInfo p;
   memset(&p, 0, sizeof(p));
   p.sType = autoSType(p);
-  p.flags = info.flags;
+  p.flags = info.flags & ~VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+  p.basePipelineIndex = -1;
+  auto base = basePipe.lock();
+  if (base && base->vk &&
+      (base->vkFlags & VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT)) {
+    p.flags |= VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+    p.basePipelineHandle = base->vk;
+  }
   stageName.at(0) = stage.entryPointName;
   p.stage = stage.info;
   p.stage.module = stage.shader->vk;
@@ -92,15 +99,16 @@ int Pipeline::ctorError(CommandPool& computeCommandPool) {
   }
   p.layout = pipelineLayout;
 
-  // TODO: Pipeline Cache.
   vk.reset();
-  v = vkCreateComputePipelines(computeCommandPool.vk.dev.dev, VK_NULL_HANDLE, 1,
-                               &p, computeCommandPool.vk.dev.dev.allocator,
-                               &vk);
+  auto& dev = computeCommandPool.vk.dev;
+  v = vkCreateComputePipelines(dev.dev, dev.pipelineCache, 1, &p,
+                               dev.dev.allocator, &vk);
   if (v != VK_SUCCESS) {
     return explainVkResult("vkCreateComputePipelines", v);
   }
   vk.onCreate();
+  vkFlags = p.flags;
+  generation++;
   return 0;
 }
 
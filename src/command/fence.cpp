@@ -8,6 +8,26 @@ int Semaphore::ctorError() {
   VkSemaphoreCreateInfo sci;
   memset(&sci, 0, sizeof(sci));
   sci.sType = autoSType(sci);
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+  VkSemaphoreTypeCreateInfoKHR stci;
+  memset(&stci, 0, sizeof(stci));
+  stci.sType = autoSType(stci);
+  stci.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+  stci.initialValue = initialValue;
+  if (timeline) {
+    if (!vk.dev.fp.waitSemaphores) {
+      logE("Semaphore::ctorError: timeline requires %s\n",
+           VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+      return 1;
+    }
+    sci.pNext = &stci;
+  }
+#else  /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
+  if (timeline) {
+    logE("Semaphore::ctorError: timeline not in this vulkan.h\n");
+    return 1;
+  }
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
   VkResult v = vkCreateSemaphore(vk.dev.dev, &sci, vk.dev.dev.allocator, &vk);
   if (v != VK_SUCCESS) {
     return explainVkResult("vkCreateSemaphore", v);
@@ -17,6 +37,66 @@ int Semaphore::ctorError() {
   return 0;
 }
 
+int Semaphore::getValue(uint64_t& value) {
+  if (!timeline) {
+    logE("Semaphore::getValue: not a timeline semaphore\n");
+    return 1;
+  }
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+  VkResult v = vk.dev.fp.getSemaphoreCounterValue(vk.dev.dev, vk, &value);
+  if (v != VK_SUCCESS) {
+    return explainVkResult("vkGetSemaphoreCounterValueKHR", v);
+  }
+  return 0;
+#else  /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
+  (void)value;
+  return 1;
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
+}
+
+VkResult Semaphore::waitNs(uint64_t value, uint64_t timeoutNanos) {
+  if (!timeline) {
+    logE("Semaphore::waitNs: not a timeline semaphore\n");
+    return VK_ERROR_INITIALIZATION_FAILED;
+  }
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+  VkSemaphore sems[] = {vk};
+  VkSemaphoreWaitInfoKHR wi;
+  memset(&wi, 0, sizeof(wi));
+  wi.sType = autoSType(wi);
+  wi.semaphoreCount = sizeof(sems) / sizeof(sems[0]);
+  wi.pSemaphores = sems;
+  wi.pValues = &value;
+  return vk.dev.fp.waitSemaphores(vk.dev.dev, &wi, timeoutNanos);
+#else  /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
+  (void)value;
+  (void)timeoutNanos;
+  return VK_ERROR_INITIALIZATION_FAILED;
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
+}
+
+int Semaphore::signal(uint64_t value) {
+  if (!timeline) {
+    logE("Semaphore::signal: not a timeline semaphore\n");
+    return 1;
+  }
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+  VkSemaphoreSignalInfoKHR si;
+  memset(&si, 0, sizeof(si));
+  si.sType = autoSType(si);
+  si.semaphore = vk;
+  si.value = value;
+  VkResult v = vk.dev.fp.signalSemaphore(vk.dev.dev, &si);
+  if (v != VK_SUCCESS) {
+    return explainVkResult("vkSignalSemaphoreKHR", v);
+  }
+  return 0;
+#else  /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
+  (void)value;
+  return 1;
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
+}
+
 int Fence::ctorError() {
   VkFenceCreateInfo fci;
   memset(&fci, 0, sizeof(fci));
@@ -61,8 +141,106 @@ int Event::ctorError() {
   return 0;
 }
 
-int CommandBuffer::validateLazyBarriers(CommandPool::lock_guard_t&) {
+namespace {  // an anonymous namespace hides its contents outside this file
+
+bool isSameRange(const VkImageSubresourceRange& a,
+                 const VkImageSubresourceRange& b) {
+  return a.aspectMask == b.aspectMask && a.baseMipLevel == b.baseMipLevel &&
+         a.levelCount == b.levelCount && a.baseArrayLayer == b.baseArrayLayer &&
+         a.layerCount == b.layerCount;
+}
+
+bool isQueueTransfer(uint32_t srcQueueFamilyIndex,
+                     uint32_t dstQueueFamilyIndex) {
+  return srcQueueFamilyIndex != dstQueueFamilyIndex;
+}
+
+}  // anonymous namespace
+
+void CommandBuffer::mergeLazyBarriers() {
   auto& b = lazyBarriers;
+  size_t before = b.mem.size() + b.buf.size() + b.img.size();
+
+  // All VkMemoryBarriers are global, so they can always be combined.
+  if (b.mem.size() > 1) {
+    for (size_t i = 1; i < b.mem.size(); i++) {
+      b.mem.at(0).srcAccessMask |= b.mem.at(i).srcAccessMask;
+      b.mem.at(0).dstAccessMask |= b.mem.at(i).dstAccessMask;
+    }
+    b.mem.resize(1);
+  }
+
+  // Combine VkBufferMemoryBarriers for exactly the same range.
+  std::vector<VkBufferMemoryBarrier> buf;
+  for (auto& next : b.buf) {
+    bool merged = false;
+    for (auto& prev : buf) {
+      if (prev.buffer == next.buffer && prev.offset == next.offset &&
+          prev.size == next.size &&
+          prev.srcQueueFamilyIndex == next.srcQueueFamilyIndex &&
+          prev.dstQueueFamilyIndex == next.dstQueueFamilyIndex) {
+        prev.srcAccessMask |= next.srcAccessMask;
+        prev.dstAccessMask |= next.dstAccessMask;
+        merged = true;
+        break;
+      }
+    }
+    if (!merged) {
+      buf.emplace_back(next);
+    }
+  }
+  b.buf.swap(buf);
+
+  // Combine VkImageMemoryBarriers for exactly the same subresource range.
+  // No commands are recorded between the barriers in lazyBarriers, so a chain
+  // of layout transitions A->B then B->C is the same as A->C.
+  std::vector<VkImageMemoryBarrier> img;
+  for (auto& next : b.img) {
+    bool merged = false;
+    // Search backwards to find the most recent barrier for this subresource.
+    for (auto it = img.rbegin(); it != img.rend(); it++) {
+      auto& prev = *it;
+      if (prev.image != next.image ||
+          !isSameRange(prev.subresourceRange, next.subresourceRange) ||
+          prev.srcQueueFamilyIndex != next.srcQueueFamilyIndex ||
+          prev.dstQueueFamilyIndex != next.dstQueueFamilyIndex) {
+        continue;
+      }
+      if (prev.oldLayout == next.oldLayout &&
+          prev.newLayout == next.newLayout) {
+        // Duplicate.
+        prev.srcAccessMask |= next.srcAccessMask;
+        prev.dstAccessMask |= next.dstAccessMask;
+        merged = true;
+      } else if (prev.newLayout == next.oldLayout &&
+                 !isQueueTransfer(prev.srcQueueFamilyIndex,
+                                  prev.dstQueueFamilyIndex)) {
+        // Collapse A->B->C.
+        prev.srcAccessMask |= next.srcAccessMask;
+        prev.dstAccessMask = next.dstAccessMask;
+        prev.newLayout = next.newLayout;
+        merged = true;
+      }
+      break;
+    }
+    if (!merged) {
+      img.emplace_back(next);
+    }
+  }
+  // Drop image barriers that do nothing.
+  b.img.clear();
+  for (auto& i : img) {
+    if (i.oldLayout == i.newLayout && !i.srcAccessMask && !i.dstAccessMask &&
+        !isQueueTransfer(i.srcQueueFamilyIndex, i.dstQueueFamilyIndex)) {
+      continue;
+    }
+    b.img.emplace_back(i);
+  }
+
+  barriersElided += before - (b.mem.size() + b.buf.size() + b.img.size());
+}
+
+int CommandBuffer::trimBarrierStages(BarrierSet& b) {
   bool found = false;
   VkPipelineStageFlags origSrc = b.srcStageMask;
   VkPipelineStageFlags origDst = b.dstStageMask;
@@ -71,7 +249,7 @@ int CommandBuffer::validateLazyBarriers(CommandPool::lock_guard_t&) {
   for (auto& mem : b.mem) {
     found = true;
     if (mem.sType != VK_STRUCTURE_TYPE_MEMORY_BARRIER) {
-      logE("lazyBarriers::mem contains invalid VkMemoryBarrier\n");
+      logE("BarrierSet::mem contains invalid VkMemoryBarrier\n");
       return 1;
     }
     VkPipelineStageFlags src = origSrc;
@@ -88,11 +266,11 @@ int CommandBuffer::validateLazyBarriers(CommandPool::lock_guard_t&) {
   for (auto& buf : b.buf) {
     found = true;
     if (buf.sType != VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER) {
-      logE("lazyBarriers::buf contains invalid VkBufferMemoryBarrier\n");
+      logE("BarrierSet::buf contains invalid VkBufferMemoryBarrier\n");
       return 1;
     }
     if (!buf.buffer) {
-      logE("lazyBarriers::buf contains invalid VkBuffer\n");
+      logE("BarrierSet::buf contains invalid VkBuffer\n");
       return 1;
     }
     VkPipelineStageFlags src = origSrc;
@@ -109,11 +287,11 @@ int CommandBuffer::validateLazyBarriers(CommandPool::lock_guard_t&) {
   for (auto& img : b.img) {
     found = true;
     if (img.sType != VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER) {
-      logE("lazyBarriers::img contains invalid VkImageMemoryBarrier\n");
+      logE("BarrierSet::img contains invalid VkImageMemoryBarrier\n");
       return 1;
     }
     if (!img.image) {
-      logE("lazyBarriers::img contains invalid VkImage\n");
+      logE("BarrierSet::img contains invalid VkImage\n");
       return 1;
     }
     VkPipelineStageFlags src = origSrc;
@@ -133,11 +311,20 @@ int CommandBuffer::validateLazyBarriers(CommandPool::lock_guard_t&) {
   if (b.dstStageMask == 0) {  // If nobody trimmed, reset b.
     b.dstStageMask = origDst;
   }
+  return found ? 0 : 2;
+}
+
+int CommandBuffer::validateLazyBarriers(CommandPool::lock_guard_t&) {
+  mergeLazyBarriers();
+  int r = trimBarrierStages(lazyBarriers);
+  if (r == 1) {
+    return 1;
+  }
   if (!vk) {
     logE("CommandBuffer::flushLazyBarriers: not allocated\n");
     return 1;
   }
-  return found ? 0 : 2;
+  return r;
 }
 
 int CommandBuffer::flushLazyBarriers(CommandPool::lock_guard_t& lock) {
@@ -187,4 +374,31 @@ int CommandBuffer::waitEvents(const std::vector<VkEvent>& events) {
   return 0;
 }
 
+int CommandBuffer::splitBarrierSignal(Event& event, BarrierSet& b) {
+  if (!event.vk) {
+    logE("splitBarrierSignal: Event::ctorError must be called first\n");
+    return 1;
+  }
+  if (trimBarrierStages(b) == 1) {
+    logE("splitBarrierSignal: invalid BarrierSet\n");
+    return 1;
+  }
+  return setEvent(event, b.srcStageMask);
+}
+
+int CommandBuffer::splitBarrierWait(Event& event, BarrierSet& b) {
+  if (!event.vk) {
+    logE("splitBarrierWait: Event::ctorError must be called first\n");
+    return 1;
+  }
+  VkEvent ev = event.vk;
+  CommandPool::lock_guard_t lock(cpool.lockmutex);
+  if (flushLazyBarriers(lock)) return 1;
+  vkCmdWaitEvents(vk, 1, &ev, b.srcStageMask, b.dstStageMask, b.mem.size(),
+                  b.mem.data(), b.buf.size(), b.buf.data(), b.img.size(),
+                  b.img.data());
+  vkCmdResetEvent(vk, ev, b.dstStageMask);
+  return 0;
+}
+
 }  // namespace command
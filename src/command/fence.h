@@ -10,6 +10,12 @@ namespace command {
 // Semaphore represents a GPU-only synchronization operation vs. Fence, below.
 // Semaphores can be waited on in any queue vs. Events which must be waited on
 // within a single queue.
+//
+// If VK_KHR_timeline_semaphore is loaded, set timeline = true before calling
+// ctorError to get a timeline semaphore: it holds a uint64_t counter that only
+// increases. The GPU waits for and signals values (see SubmitInfo), and the
+// CPU can also wait for and signal values, so one timeline semaphore can
+// replace a Fence for each submit.
 typedef struct Semaphore {
   Semaphore(language::Device& dev) : vk{dev, vkDestroySemaphore} {
     vk.allocator = dev.dev.allocator;
@@ -17,6 +23,23 @@ typedef struct Semaphore {
   // Two-stage constructor: call ctorError() to build Semaphore.
   WARN_UNUSED_RESULT int ctorError();
 
+  // getValue reads the counter of a timeline semaphore.
+  WARN_UNUSED_RESULT int getValue(uint64_t& value);
+
+  // waitNs waits for the counter of a timeline semaphore to reach value.
+  // The result MUST be checked for multiple possible success states.
+  WARN_UNUSED_RESULT VkResult waitNs(uint64_t value, uint64_t timeoutNanos);
+
+  // waitMs waits for the counter of a timeline semaphore to reach value.
+  // The result MUST be checked for multiple possible success states.
+  WARN_UNUSED_RESULT VkResult waitMs(uint64_t value, uint64_t timeoutMillis) {
+    return waitNs(value, timeoutMillis * 1000000llu);
+  }
+
+  // signal sets the counter of a timeline semaphore to value from the CPU.
+  // value must be greater than the current value.
+  WARN_UNUSED_RESULT int signal(uint64_t value);
+
   // setName forwards the setName call to vk.
   WARN_UNUSED_RESULT int setName(const std::string& name) {
     return vk.setName(name);
@@ -24,6 +47,11 @@ typedef struct Semaphore {
   // getName forwards the getName call to vk.
   const std::string& getName() const { return vk.getName(); }
 
+  // timeline must be set before ctorError to create a timeline semaphore.
+  bool timeline{false};
+  // initialValue is the starting value of a timeline semaphore.
+  uint64_t initialValue{0};
+
   // vk is the raw VkSemaphore.
   VkDebugPtr<VkSemaphore> vk;
 } Semaphore;
@@ -89,14 +117,26 @@ typedef struct Event {
 
 // SemaphoreStageMaskPair helps command::SubmitInfo be a little clearer - this
 // is very close to a std::pair<VkSemaphore, VkPipelineStageFlags>.
+//
+// A raw VkSemaphore cannot be queried for its type, so it is assumed to be a
+// timeline semaphore only if value is not 0 or isTimeline is true.
 typedef struct SemaphoreStageMaskPair {
-  explicit SemaphoreStageMaskPair(Semaphore& sem, VkPipelineStageFlags stage)
-      : sem(sem.vk), dstStage(stage) {}
-  explicit SemaphoreStageMaskPair(VkSemaphore sem, VkPipelineStageFlags stage)
-      : sem(sem), dstStage(stage) {}
+  explicit SemaphoreStageMaskPair(Semaphore& sem, VkPipelineStageFlags stage,
+                                  uint64_t value = 0)
+      : sem(sem.vk), dstStage(stage), value(value), timeline(sem.timeline) {}
+  explicit SemaphoreStageMaskPair(VkSemaphore sem, VkPipelineStageFlags stage,
+                                  uint64_t value = 0, bool isTimeline = false)
+      : sem(sem),
+        dstStage(stage),
+        value(value),
+        timeline(isTimeline || value != 0) {}
 
   VkSemaphore sem;
   VkPipelineStageFlags dstStage;
+  // value is the value to wait for if sem is a timeline semaphore.
+  uint64_t value;
+  // timeline is true if sem is a timeline semaphore.
+  bool timeline;
 } SemaphoreStageMaskPair;
 
 }  // namespace command
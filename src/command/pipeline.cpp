@@ -4,6 +4,8 @@
  */
 #include <gli/gli.hpp>
 
+#include <algorithm>
+
 #include "command.h"
 
 namespace command {
@@ -101,7 +103,9 @@ Pipeline::Pipeline(RenderPass& pass_)
 
 Pipeline::~Pipeline() {}
 
-int Pipeline::ctorError(RenderPass& pass, size_t subpass_i) {
+int Pipeline::makeCreateInfo(RenderPass& pass, size_t subpass_i,
+                             CreateInfoStorage& storage,
+                             VkGraphicsPipelineCreateInfo& p) {
   if (subpass_i >= pass.pipelines.size()) {
     logE("Pipeline::init(): subpass_i=%zu when pass.pipeline.size=%zu\n",
          subpass_i, pass.pipelines.size());
@@ -148,12 +152,21 @@ int Pipeline::ctorError(RenderPass& pass, size_t subpass_i) {
   }
   pipelineLayout.onCreate();
 
-  VkGraphicsPipelineCreateInfo p;
   memset(&p, 0, sizeof(p));
   p.sType = autoSType(p);
-  p.flags = info.flags;
-  std::vector<VkPipelineShaderStageCreateInfo> stageCreateInfo;
-  std::vector<VkSpecializationInfo> specInfo(info.stages.size());
+  p.flags = info.flags & ~VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+  p.basePipelineIndex = -1;
+  auto base = basePipe.lock();
+  if (base && base->vk &&
+      (base->vkFlags & VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT)) {
+    p.flags |= VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+    p.basePipelineHandle = base->vk;
+  }
+  auto& stageCreateInfo = storage.stages;
+  auto& specInfo = storage.specInfo;
+  stageCreateInfo.clear();
+  specInfo.clear();
+  specInfo.resize(info.stages.size());
   stageName.resize(info.stages.size());
   for (size_t i = 0; i < info.stages.size(); i++) {
     auto& stage = info.stages.at(i);
@@ -178,26 +191,42 @@ int Pipeline::ctorError(RenderPass& pass, size_t subpass_i) {
   p.pMultisampleState = &info.multisci;
   p.pDepthStencilState = &info.depthsci;
   p.pColorBlendState = &info.cbsci;
-  VkPipelineDynamicStateCreateInfo dsci;
+  auto& dsci = storage.dsci;
   memset(&dsci, 0, sizeof(dsci));
   dsci.sType = autoSType(dsci);
   if (info.dynamicStates.size()) {
-    dsci.dynamicStateCount = info.dynamicStates.size();
-    dsci.pDynamicStates = info.dynamicStates.data();
+    // Vulkan does not allow a VkDynamicState to be listed twice.
+    auto& ds = storage.dynamicStates;
+    ds = info.dynamicStates;
+    std::sort(ds.begin(), ds.end());
+    ds.erase(std::unique(ds.begin(), ds.end()), ds.end());
+    dsci.dynamicStateCount = ds.size();
+    dsci.pDynamicStates = ds.data();
     p.pDynamicState = &dsci;
   }
   p.layout = pipelineLayout;
   p.renderPass = pass.vk;
   p.subpass = subpass_i;
+  return 0;
+}
+
+int Pipeline::ctorError(RenderPass& pass, size_t subpass_i) {
+  CreateInfoStorage storage;
+  VkGraphicsPipelineCreateInfo p;
+  if (makeCreateInfo(pass, subpass_i, storage, p)) {
+    return 1;
+  }
 
-  // TODO: Pipeline Cache.
   vk.reset();
-  v = vkCreateGraphicsPipelines(pass.vk.dev.dev, VK_NULL_HANDLE, 1, &p,
-                                pass.vk.dev.dev.allocator, &vk);
+  VkResult v =
+      vkCreateGraphicsPipelines(pass.vk.dev.dev, pass.vk.dev.pipelineCache, 1,
+                                &p, pass.vk.dev.dev.allocator, &vk);
   if (v != VK_SUCCESS) {
     return explainVkResult("vkCreateGraphicsPipelines", v);
   }
   vk.onCreate();
+  vkFlags = p.flags;
+  generation++;
   return 0;
 }
 
@@ -89,13 +89,28 @@ int RenderPass::ctorError() {
   vk.allocator = vk.dev.dev.allocator;
   vk.onCreate();
 
-  for (size_t subpass_i = 0; subpass_i < pipelines.size(); subpass_i++) {
-    auto& pipeline = pipelines.at(subpass_i);
-    if (pipeline->ctorError(*this, subpass_i)) {
+  // A derivative reads basePipe->vk while it is created, so any basePipe
+  // forces the single batched call instead of racing the base's thread.
+  bool hasBase = false;
+  for (auto& pipe : pipelines) {
+    hasBase |= pipe && !pipe->basePipe.expired();
+  }
+  std::vector<size_t> failed;
+  if (maxThreads < 2 || hasBase) {
+    if (ctorPipelines()) {
+      return 1;
+    }
+  } else if (PipelineBatch::forEach(
+                 pipelines.size(), maxThreads,
+                 [this](size_t subpass_i) -> int {
+                   return pipelines.at(subpass_i)->ctorError(*this, subpass_i);
+                 },
+                 failed)) {
+    for (auto subpass_i : failed) {
       logE("%s: pipeline[%zu].ctorError failed\n", "RenderPass::ctorError",
            subpass_i);
-      return 1;
     }
+    return 1;
   }
 
   // If non-default target image:
@@ -127,4 +142,59 @@ int RenderPass::ctorError() {
   return 0;
 }
 
+int RenderPass::ctorPipelines() {
+  // storage must not be resized after makeCreateInfo: p points into it.
+  std::vector<Pipeline::CreateInfoStorage> storage(pipelines.size());
+  std::vector<VkGraphicsPipelineCreateInfo> p(pipelines.size());
+  int r = 0;
+  for (size_t i = 0; i < pipelines.size(); i++) {
+    if (pipelines.at(i)->makeCreateInfo(*this, i, storage.at(i), p.at(i))) {
+      logE("%s: pipeline[%zu].makeCreateInfo failed\n",
+           "RenderPass::ctorError", i);
+      r = 1;
+    }
+  }
+  if (r) {
+    return r;
+  }
+
+  // A derivative of a pipeline earlier in this batch refers to it by index.
+  for (size_t i = 0; i < pipelines.size(); i++) {
+    auto base = pipelines.at(i)->basePipe.lock();
+    for (size_t j = 0; base && j < i; j++) {
+      if (pipelines.at(j) == base &&
+          (p.at(j).flags & VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT)) {
+        p.at(i).flags |= VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+        p.at(i).basePipelineHandle = VK_NULL_HANDLE;
+        p.at(i).basePipelineIndex = j;
+        break;
+      }
+    }
+  }
+
+  std::vector<VkPipeline> out(pipelines.size(), VK_NULL_HANDLE);
+  VkResult v =
+      vkCreateGraphicsPipelines(vk.dev.dev, vk.dev.pipelineCache, p.size(),
+                                p.data(), vk.dev.dev.allocator, out.data());
+  if (v != VK_SUCCESS) {
+    r = explainVkResult("vkCreateGraphicsPipelines", v);
+  }
+  // If some pipelines failed, the driver still creates the others and sets
+  // the failed ones to VK_NULL_HANDLE.
+  for (size_t i = 0; i < pipelines.size(); i++) {
+    auto& pipe = *pipelines.at(i);
+    pipe.vk.reset();
+    if (out.at(i) == VK_NULL_HANDLE) {
+      logE("%s: pipeline[%zu] failed\n", "RenderPass::ctorError", i);
+      r = 1;
+      continue;
+    }
+    *&pipe.vk = out.at(i);
+    pipe.vk.onCreate();
+    pipe.vkFlags = p.at(i).flags;
+    pipe.generation++;
+  }
+  return r;
+}
+
 }  // namespace command
@@ -5,6 +5,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+
 #include "command.h"
 #if defined(__GLIBC__) || defined(__ANDROID__) || defined(__APPLE__)
 #include <sys/mman.h>
@@ -17,6 +19,27 @@
 
 namespace command {
 
+namespace {
+
+// checkBytes is a second hash for ShaderCache. It is a different function
+// than language::hashBytes (FNV-1a): it mixes 32-bit words with a
+// multiply-xorshift, so a collision in one is not a collision in the other.
+// Neither is a cryptographic hash.
+uint64_t checkBytes(const void* data, size_t len) {
+  auto p = reinterpret_cast<const unsigned char*>(data);
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+  for (size_t i = 0; i < len; i += 4) {
+    uint32_t w = 0;
+    memcpy(&w, p + i, std::min(len - i, (size_t)4));
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+  }
+  h *= 0xc4ceb9fe1a85ec53ull;
+  return h ^ (h >> 29);
+}
+
+}  // anonymous namespace
+
 int Shader::loadSPV(const uint32_t* spvBegin, size_t len) {
   if ((len & 3) != 0) {
     logE("LoadSPV(%p, %zu): len must be a multiple of 4\n", spvBegin, len);
@@ -27,7 +50,13 @@ int Shader::loadSPV(const uint32_t* spvBegin, size_t len) {
     std::vector<uint32_t> spv{spvBegin, spvBegin + len / sizeof(*spvBegin)};
     bytes.swap(spv);
   }
+  mapping.reset();
+  mapped = nullptr;
+  mappedLen = 0;
+  return createModule(spvBegin, len);
+}
 
+int Shader::createModule(const uint32_t* spvBegin, size_t len) {
   VkShaderModuleCreateInfo smci;
   memset(&smci, 0, sizeof(smci));
   smci.sType = autoSType(smci);
@@ -57,4 +86,125 @@ int Shader::loadSPV(const char* filename) {
   return loadSPV(map, infile.len);
 }
 
+int Shader::mapSPV(std::shared_ptr<MMapFile> file, size_t offset,
+                   size_t len /*= 0*/) {
+  if (!file || !file->map) {
+    logE("mapSPV: file is not mapped\n");
+    return 1;
+  }
+  if (offset > (size_t)file->len || len > (size_t)file->len - offset) {
+    logE("mapSPV(%zu, %zu): out of range, file len=%lld\n", offset, len,
+         (long long)file->len);
+    return 1;
+  }
+  if (!len) {
+    len = file->len - offset;
+  }
+  const char* p = reinterpret_cast<const char*>(file->map) + offset;
+  if ((len & 3) != 0 || (reinterpret_cast<uintptr_t>(p) & 3) != 0) {
+    logE("mapSPV(%zu, %zu): must be 4-byte aligned\n", offset, len);
+    return 1;
+  }
+  std::vector<uint32_t>().swap(bytes);
+  mapping = file;
+  mapped = reinterpret_cast<const uint32_t*>(p);
+  mappedLen = len;
+  return createModule(mapped, mappedLen);
+}
+
+int Shader::mapSPV(const char* filename) {
+  auto file = std::make_shared<MMapFile>();
+  if (file->mmapRead(filename)) {
+    logE("mapSPV: mmapRead(%s) failed\n", filename);
+    return 1;
+  }
+  return mapSPV(file, 0);
+}
+
+int ShaderCache::load(const uint32_t* spv, size_t len,
+                      std::shared_ptr<Shader>& out) {
+  return loadOrMap(spv, len, std::shared_ptr<MMapFile>(), out);
+}
+
+int ShaderCache::loadOrMap(const uint32_t* spv, size_t len,
+                           std::shared_ptr<MMapFile> file,
+                           std::shared_ptr<Shader>& out) {
+  uint64_t hash = language::hashBytes(spv, len);
+  uint64_t check = checkBytes(spv, len);
+  std::lock_guard<std::mutex> lock(lockmutex);
+  auto range = shaders.equal_range(hash);
+  for (auto it = range.first; it != range.second;) {
+    auto shader = it->second.shader.lock();
+    if (!shader) {
+      // Remove entries for Shaders that have been destroyed.
+      it = shaders.erase(it);
+      continue;
+    }
+    if (it->second.len == len && it->second.check == check &&
+        (!shader->code() || !memcmp(shader->code(), spv, len))) {
+      hits++;
+      out = shader;
+      return 0;
+    }
+    it++;
+  }
+
+  auto shader = std::make_shared<Shader>(dev);
+  if (file) {
+    size_t offset = reinterpret_cast<const char*>(spv) -
+                    reinterpret_cast<const char*>(file->map);
+    if (shader->mapSPV(file, offset, len)) {
+      logE("ShaderCache::load: mapSPV failed\n");
+      return 1;
+    }
+  } else if (shader->loadSPV(spv, len)) {
+    logE("ShaderCache::load: loadSPV failed\n");
+    return 1;
+  }
+  Entry e;
+  e.shader = shader;
+  e.len = len;
+  e.check = check;
+  shaders.emplace(hash, e);
+  misses++;
+  out = shader;
+  return 0;
+}
+
+int ShaderCache::load(const char* filename, std::shared_ptr<Shader>& out) {
+  auto file = std::make_shared<MMapFile>();
+  if (file->mmapRead(filename)) {
+    logE("ShaderCache::load: mmapRead(%s) failed\n", filename);
+    return 1;
+  }
+  // A new Shader keeps file mapped. If the cache has it, file is unmapped.
+  return loadOrMap(reinterpret_cast<const uint32_t*>(file->map), file->len,
+                   file, out);
+}
+
+int ShaderCache::load(std::shared_ptr<MMapFile> file, size_t offset,
+                      size_t len, std::shared_ptr<Shader>& out) {
+  if (!file || !file->map || offset > (size_t)file->len ||
+      len > (size_t)file->len - offset) {
+    logE("ShaderCache::load(%zu, %zu): file not mapped or out of range\n",
+         offset, len);
+    return 1;
+  }
+  if (!len) {
+    len = file->len - offset;
+  }
+  auto p = reinterpret_cast<const char*>(file->map) + offset;
+  return loadOrMap(reinterpret_cast<const uint32_t*>(p), len, file, out);
+}
+
+void ShaderCache::releaseBytes() {
+  std::lock_guard<std::mutex> lock(lockmutex);
+  for (auto& kv : shaders) {
+    auto shader = kv.second.shader.lock();
+    if (shader) {
+      shader->releaseBytes();
+    }
+  }
+}
+
 }  // namespace command
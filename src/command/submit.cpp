@@ -0,0 +1,136 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ *
+ * Implements SubmitThread, which coalesces SubmitInfo from many threads into
+ * as few vkQueueSubmit calls as possible.
+ */
+
+#include <algorithm>
+
+#include "command.h"
+
+namespace command {
+
+SubmitThread::~SubmitThread() { stop(); }
+
+int SubmitThread::ctorError() {
+  if (thread.joinable()) {
+    logE("SubmitThread::ctorError: already started\n");
+    return 1;
+  }
+  if (!cpool.vk) {
+    logE("SubmitThread::ctorError: call cpool.ctorError first\n");
+    return 1;
+  }
+  std::lock_guard<std::mutex> lock(lockmutex);
+  quit = false;
+  thread = std::thread(&SubmitThread::threadMain, this);
+  return 0;
+}
+
+void SubmitThread::stop() {
+  {
+    std::lock_guard<std::mutex> lock(lockmutex);
+    quit = true;
+  }
+  wake.notify_all();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+int SubmitThread::enqueue(SubmitInfo info, VkFence fence /*= VK_NULL_HANDLE*/) {
+  Item item;
+  item.info = std::move(info);
+  item.fence = fence;
+  item.t = clock::now();
+  {
+    std::lock_guard<std::mutex> lock(lockmutex);
+    if (!thread.joinable() || quit) {
+      logE("SubmitThread::enqueue: thread is not running\n");
+      return 1;
+    }
+    pending.emplace_back(std::move(item));
+  }
+  wake.notify_one();
+  return 0;
+}
+
+int SubmitThread::flush() {
+  std::unique_lock<std::mutex> lock(lockmutex);
+  idle.wait(lock, [&] { return pending.empty() && !busy; });
+  int r = failed ? 1 : 0;
+  failed = 0;
+  return r;
+}
+
+SubmitThread::Stats SubmitThread::getStats() {
+  std::lock_guard<std::mutex> lock(lockmutex);
+  return stats;
+}
+
+void SubmitThread::resetStats() {
+  std::lock_guard<std::mutex> lock(lockmutex);
+  stats = Stats();
+}
+
+void SubmitThread::threadMain() {
+  std::unique_lock<std::mutex> lock(lockmutex);
+  for (;;) {
+    wake.wait(lock, [&] { return quit || !pending.empty(); });
+    if (pending.empty()) {
+      // quit is set and everything has been submitted.
+      return;
+    }
+    std::vector<Item> work;
+    work.swap(pending);
+    busy = true;
+    lock.unlock();
+
+    Stats s;
+    int r = submitAll(work, s);
+
+    lock.lock();
+    busy = false;
+    failed += r;
+    stats.submits += s.submits;
+    stats.infos += s.infos;
+    stats.maxBatch = std::max(stats.maxBatch, s.maxBatch);
+    stats.latencyNs += s.latencyNs;
+    stats.maxLatencyNs = std::max(stats.maxLatencyNs, s.maxLatencyNs);
+    idle.notify_all();
+  }
+}
+
+int SubmitThread::submitAll(std::vector<Item>& work, Stats& s) {
+  int result = 0;
+  std::vector<SubmitInfo> batch;
+  size_t first = 0;
+  for (size_t i = 0; i < work.size(); i++) {
+    batch.emplace_back(std::move(work.at(i).info));
+    if (work.at(i).fence == VK_NULL_HANDLE && i + 1 < work.size()) {
+      continue;
+    }
+    {
+      CommandPool::lock_guard_t lock(cpool.lockmutex);
+      if (cpool.submit(lock, poolQindex, batch, work.at(i).fence)) {
+        logE("SubmitThread: submit of %zu SubmitInfo failed\n", batch.size());
+        result = 1;
+      }
+    }
+    auto now = clock::now();
+    s.submits++;
+    s.infos += batch.size();
+    s.maxBatch = std::max(s.maxBatch, batch.size());
+    for (; first <= i; first++) {
+      uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        now - work.at(first).t)
+                        .count();
+      s.latencyNs += ns;
+      s.maxLatencyNs = std::max(s.maxLatencyNs, ns);
+    }
+    batch.clear();
+  }
+  return result;
+}
+
+}  // namespace command
@@ -0,0 +1,137 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ *
+ * Implements PipelineVariants, a cache of specialized copies of a Pipeline.
+ */
+
+#include "command.h"
+
+namespace command {
+
+bool PipelineVariants::Variant::matches(const Spec& s) const {
+  if (s.flags != flags || s.map.size() != map.size() ||
+      s.info.dataSize != data.size()) {
+    return false;
+  }
+  if (!map.empty() &&
+      memcmp(s.map.data(), map.data(), map.size() * sizeof(map.at(0)))) {
+    return false;
+  }
+  return data.empty() || !memcmp(s.info.pData, data.data(), data.size());
+}
+
+int PipelineVariants::getVariant(CommandPool* cpool, RenderPass* pass,
+                                 size_t subpass_i,
+                                 std::shared_ptr<Pipeline> base,
+                                 const Spec& s, bool isAsync,
+                                 std::shared_ptr<Pipeline>& out) {
+  if (!base) {
+    logE("PipelineVariants: base is NULL\n");
+    return 1;
+  }
+  std::unique_lock<std::mutex> lock(lockmutex);
+  auto key = std::make_pair(base.get(), s.hash);
+  auto it = variants.find(key);
+  std::shared_ptr<Variant> v;
+  if (it != variants.end()) {
+    v = it->second;
+    if (!v->matches(s)) {
+      logE("PipelineVariants: variant %llx: hash collision\n",
+           (unsigned long long)s.hash);
+      return 1;
+    }
+  } else {
+    if (base->info.stages.empty()) {
+      logE("PipelineVariants: base has no stages\n");
+      return 1;
+    }
+    std::shared_ptr<Pipeline> pipe;
+    if (pass) {
+      pipe = std::make_shared<Pipeline>(*pass);
+    } else {
+      auto& stage = base->info.stages.at(0);
+      pipe = std::make_shared<Pipeline>(*cpool, stage.shader,
+                                        stage.entryPointName);
+    }
+    pipe->info = base->info;
+    pipe->commandBufferType = base->commandBufferType;
+    pipe->clearColors = base->clearColors;
+    pipe->basePipe = base;
+    bool found = false;
+    for (auto& stage : pipe->info.stages) {
+      if (stage.info.stage == s.flags) {
+        found = true;
+        stage.specialize(s.map, s.info);
+      }
+    }
+    if (!found) {
+      logE("PipelineVariants: no stages matched %x\n", s.flags);
+      return 1;
+    }
+
+    // Insert v as a placeholder, then build it without holding lockmutex.
+    v = std::make_shared<Variant>();
+    v->base = base;
+    v->flags = s.flags;
+    v->map = s.map;
+    auto bytes = reinterpret_cast<const char*>(s.info.pData);
+    v->data.assign(bytes, bytes + s.info.dataSize);
+    v->pipe = pipe;
+    variants.emplace(key, v);
+    Variant* raw = v.get();
+    v->result = std::async(
+        std::launch::async, [this, raw, pipe, cpool, pass, subpass_i]() {
+          int r = pass ? pipe->ctorError(*pass, subpass_i)
+                       : pipe->ctorError(*cpool);
+          {
+            std::lock_guard<std::mutex> lock(lockmutex);
+            raw->building = false;
+            raw->failed = r != 0;
+          }
+          built.notify_all();
+        });
+  }
+
+  if (v->building) {
+    if (isAsync) {
+      out = base;
+      return 0;
+    }
+    built.wait(lock, [&v]() -> bool { return !v->building; });
+  }
+  if (v->failed) {
+    if (isAsync) {
+      if (!v->reported) {
+        logE("PipelineVariants: variant %llx failed\n",
+             (unsigned long long)s.hash);
+        v->reported = true;
+      }
+      out = base;
+      return 0;
+    }
+    logE("PipelineVariants: variant %llx failed\n",
+         (unsigned long long)s.hash);
+    return 1;
+  }
+  out = v->pipe;
+  return 0;
+}
+
+void PipelineVariants::clear() {
+  std::map<std::pair<Pipeline*, uint64_t>, std::shared_ptr<Variant>> old;
+  {
+    std::unique_lock<std::mutex> lock(lockmutex);
+    // A Variant being built is still written to by its thread.
+    built.wait(lock, [this]() -> bool {
+      for (auto& kv : variants) {
+        if (kv.second->building) {
+          return false;
+        }
+      }
+      return true;
+    });
+    old.swap(variants);
+  }
+  // Destroy old outside lockmutex: each Variant::result joins its thread.
+}
+
+}  // namespace command
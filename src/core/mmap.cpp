@@ -1,6 +1,6 @@
 /* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
  *
- * Platform-independent mmap implementation.
+ * Platform-independent mmap implementation, and writeFileAtomic.
  */
 #include "structs.h"
 #ifdef _WIN32
@@ -15,6 +15,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <atomic>
+
 MMapFile::~MMapFile() { (void)munmap(); }
 
 int MMapFile::munmap() {
@@ -148,3 +150,88 @@ int MMapFile::mmapRead(const char* filename, int64_t offset /*= 0*/,
 #endif
   return 0;
 }
+
+int writeFileAtomic(const char* filename, const void* data, size_t len) {
+  // The temp file must have a unique name. Two processes (or two threads)
+  // writing filename at the same time must not write into the same file.
+  std::string tmpName(filename);
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__ANDROID__)
+  tmpName += ".XXXXXX";
+  // mkstemp creates the file with mode 0600.
+  int fd = mkstemp(&tmpName[0]);
+  if (fd < 0) {
+    logE("writeFileAtomic: mkstemp(%s) failed: %d %s\n", tmpName.c_str(),
+         errno, strerror(errno));
+    return 1;
+  }
+  FILE* f = fdopen(fd, "wb");
+  if (!f) {
+    logE("writeFileAtomic: fdopen(%s) failed: %d %s\n", tmpName.c_str(), errno,
+         strerror(errno));
+    close(fd);
+    (void)remove(tmpName.c_str());
+    return 1;
+  }
+#elif defined(_WIN32)
+  static std::atomic<uint32_t> counter{0};
+  char suffix[64];
+  snprintf(suffix, sizeof(suffix), ".%lu.%u.tmp",
+           (unsigned long)::GetCurrentProcessId(), (unsigned)counter++);
+  tmpName += suffix;
+  FILE* f = fopen(tmpName.c_str(), "wb");
+  if (!f) {
+    logE("writeFileAtomic: fopen(%s) failed: %d %s\n", tmpName.c_str(), errno,
+         strerror(errno));
+    return 1;
+  }
+#else
+#error unsupported platform for writeFileAtomic
+#endif
+  if (len && fwrite(data, 1, len, f) != len) {
+    logE("writeFileAtomic: fwrite(%s) failed: %d %s\n", tmpName.c_str(), errno,
+         strerror(errno));
+    fclose(f);
+    (void)remove(tmpName.c_str());
+    return 1;
+  }
+  if (fflush(f)) {
+    logE("writeFileAtomic: fflush(%s) failed: %d %s\n", tmpName.c_str(), errno,
+         strerror(errno));
+    fclose(f);
+    (void)remove(tmpName.c_str());
+    return 1;
+  }
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__ANDROID__)
+  if (fsync(fileno(f)) < 0) {
+    logE("writeFileAtomic: fsync(%s) failed: %d %s\n", tmpName.c_str(), errno,
+         strerror(errno));
+    fclose(f);
+    (void)remove(tmpName.c_str());
+    return 1;
+  }
+#endif
+  if (fclose(f)) {
+    logE("writeFileAtomic: fclose(%s) failed: %d %s\n", tmpName.c_str(), errno,
+         strerror(errno));
+    (void)remove(tmpName.c_str());
+    return 1;
+  }
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__ANDROID__)
+  if (rename(tmpName.c_str(), filename) < 0) {
+    logE("writeFileAtomic: rename(%s) failed: %d %s\n", filename, errno,
+         strerror(errno));
+    (void)remove(tmpName.c_str());
+    return 1;
+  }
+#elif defined(_WIN32)
+  if (!::MoveFileEx(tmpName.c_str(), filename, MOVEFILE_REPLACE_EXISTING)) {
+    auto e = ::GetLastError();
+    logE("writeFileAtomic: MoveFileEx(%s) failed: %u\n", filename, e);
+    (void)remove(tmpName.c_str());
+    return 1;
+  }
+#else
+#error unsupported platform for writeFileAtomic
+#endif
+  return 0;
+}
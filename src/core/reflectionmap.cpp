@@ -155,6 +155,10 @@ void DeviceFeatures::reset() {
   descriptorIndexing.sType = autoSType(descriptorIndexing);
   memset(&memoryModel, 0, sizeof(memoryModel));
   memoryModel.sType = autoSType(memoryModel);
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+  memset(&timelineSemaphore, 0, sizeof(timelineSemaphore));
+  timelineSemaphore.sType = autoSType(timelineSemaphore);
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
 }
 
 int DeviceFeatures::getFeatures(Device& dev) {
@@ -195,6 +199,9 @@ int DeviceFeatures::getFeatures(Device& dev) {
 #ifdef VK_KHR_VULKAN_MEMORY_MODEL_EXTENSION_NAME
   ifExtension(VK_KHR_VULKAN_MEMORY_MODEL_EXTENSION_NAME, memoryModel);
 #endif /* VK_KHR_VULKAN_MEMORY_MODEL_EXTENSION_NAME */
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+  ifExtension(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME, timelineSemaphore);
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
 
   pfn(dev.phys, this);
   return 0;
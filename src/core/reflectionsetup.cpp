@@ -106,6 +106,9 @@ void DeviceFeatures::setupReflect() {
     VK_KHR_VULKAN_MEMORY_MODEL_SPEC_VERSION >= 3
   ADD_FIELD(memoryModel, vulkanMemoryModelAvailabilityVisibilityChains);
 #endif /* VK_KHR_VULKAN_MEMORY_MODEL_SPEC_VERSION >= 3 */
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+  ADD_FIELD(timelineSemaphore, timelineSemaphore);
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
 #undef ADD_FIELD
 
   reset();
@@ -80,6 +80,11 @@ struct DeviceFeatures : VkPhysicalDeviceFeatures2 {
   // Used if VK_KHR_vulkan_memory_model
   VkPhysicalDeviceVulkanMemoryModelFeaturesKHR memoryModel;
 
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+  // Used if VK_KHR_timeline_semaphore:
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineSemaphore;
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
+
   VolcanoReflectionMap reflect;
 
  private:
@@ -498,6 +503,12 @@ typedef struct DeviceFunctionPointers {
   PFN_vkCmdSetSampleLocationsEXT setSampleLocations{nullptr};
   PFN_vkGetPhysicalDeviceMultisamplePropertiesEXT
       getPhysicalDeviceMultisampleProperties{nullptr};
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+  // If VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME is loaded:
+  PFN_vkGetSemaphoreCounterValueKHR getSemaphoreCounterValue{nullptr};
+  PFN_vkWaitSemaphoresKHR waitSemaphores{nullptr};
+  PFN_vkSignalSemaphoreKHR signalSemaphore{nullptr};
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
 } DeviceFunctionPointers;
 
 // SurfaceCapabilities gathers all the structures that are supported by
@@ -532,6 +543,18 @@ struct SurfaceCapabilities : VkSurfaceCapabilities2KHR {
   VkSurfaceProtectedCapabilitiesKHR drm;
 };
 
+// hashBytes returns a 64-bit FNV-1a hash of len bytes at data. Pass a previous
+// result as seed to hash several buffers as if they were one. This is not a
+// cryptographic hash.
+inline uint64_t hashBytes(const void* data, size_t len,
+                          uint64_t seed = 0xcbf29ce484222325ull) {
+  auto p = reinterpret_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < len; i++) {
+    seed = (seed ^ p[i]) * 0x100000001b3ull;
+  }
+  return seed;
+}
+
 }  // namespace language
 
 #ifdef _WIN32
@@ -580,3 +603,11 @@ typedef struct MMapFile {
   void* winMmapHandle;
   int fd;
 } MMapFile;
+
+// writeFileAtomic writes len bytes from data to a temporary file, then renames
+// it over filename. Readers of filename never see a partially written file.
+// The temporary file has a unique name, so concurrent writers do not corrupt
+// each other: the last rename wins. On POSIX the file gets mode 0600.
+// Returns 0=success, 1=failure.
+WARN_UNUSED_RESULT int writeFileAtomic(const char* filename, const void* data,
+                                       size_t len);
@@ -72,6 +72,7 @@ int Framebuf::ctorError(VkRenderPass renderPass, uint32_t width,
   }
   vk.allocator = vk.dev.dev.allocator;
   vk.onCreate();
+  generation++;
   return 0;
 }
 
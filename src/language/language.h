@@ -242,6 +242,8 @@ typedef struct Framebuf {
 
   // vk is the vulkan VkFrameBuffer object. resetSwapChain() overwrites it.
   VkDebugPtr<VkFramebuffer> vk;
+  // generation is incremented each time vk is created.
+  uint64_t generation{0};
 
   // depthImageViewAt1 indicates whether attachments.at(1) is the depth buffer.
   // This prevents resetSwapChain() from getting confused and mistaking an
@@ -362,6 +364,29 @@ typedef struct Device {
   // Instance::requiredExtensions.
   int isExtensionLoaded(const char* name);
 
+  // pipelineCache is passed to every vkCreateGraphicsPipelines and
+  // vkCreateComputePipelines call. open() creates an empty pipelineCache.
+  // Call loadPipelineCache() to replace it with one loaded from disk.
+  VkDebugPtr<VkPipelineCache> pipelineCache{*this, vkDestroyPipelineCache};
+
+  // pipelineCacheFile is set by loadPipelineCache() and used by
+  // savePipelineCache().
+  std::string pipelineCacheFile;
+
+  // loadPipelineCache recreates pipelineCache from a file in dir. The file
+  // name includes the vendorID, deviceID, driverVersion and
+  // pipelineCacheUUID, so a driver upgrade uses a new file.
+  //
+  // A missing file, or a file with a header that does not match this device,
+  // is not an error: pipelineCache is just created empty.
+  //
+  // Call loadPipelineCache() after open() and before creating pipelines.
+  WARN_UNUSED_RESULT int loadPipelineCache(const std::string& dir);
+
+  // savePipelineCache writes pipelineCache to pipelineCacheFile, replacing
+  // it atomically so a crash never leaves a partial file.
+  WARN_UNUSED_RESULT int savePipelineCache();
+
   // valid after resetSwapChain(), typically via onResized()
   VkDebugPtr<VkSwapchainKHR> swapChain{*this, vkDestroySwapchainKHR};
   // framebufs is populated after resetSwapChain().
@@ -94,6 +94,17 @@ void DeviceFunctionPointers::load(Device& dev) {
       addr.emplace_back(ext, "vkGetPhysicalDeviceMultisamplePropertiesEXT",
                         reinterpret_cast<PFN_vkVoidFunction*>(
                             &getPhysicalDeviceMultisampleProperties));
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+    } else if (ext == VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) {
+      addr.emplace_back(
+          ext, "vkGetSemaphoreCounterValueKHR",
+          reinterpret_cast<PFN_vkVoidFunction*>(&getSemaphoreCounterValue));
+      addr.emplace_back(ext, "vkWaitSemaphoresKHR",
+                        reinterpret_cast<PFN_vkVoidFunction*>(&waitSemaphores));
+      addr.emplace_back(
+          ext, "vkSignalSemaphoreKHR",
+          reinterpret_cast<PFN_vkVoidFunction*>(&signalSemaphore));
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
     }
   }
 
@@ -199,6 +210,17 @@ int Instance::open(VkExtent2D surfaceSizeRequest) {
       allQci.push_back(dqci);
     }
 
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+    // Timeline semaphores are useless unless the feature is also enabled.
+    for (auto& ext : dev.requiredExtensions) {
+      if (ext == VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME &&
+          dev.enabledFeatures.set("timelineSemaphore", VK_TRUE)) {
+        logE("enabledFeatures.set(%s, true) failed\n", "timelineSemaphore");
+        return 1;
+      }
+    }
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
+
     // Check dev.enableFeatures against dev.availableFeatures.
     for (const auto kv : dev.enabledFeatures.reflect) {
       const auto& name = kv.first.c_str();
@@ -224,6 +246,25 @@ int Instance::open(VkExtent2D surfaceSizeRequest) {
       dCreateInfo.pEnabledFeatures = NULL;
       dCreateInfo.pNext = &dev.enabledFeatures;
     }
+#ifdef VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME
+    // Copy descriptorIndexing to chain it without modifying enabledFeatures.
+    auto descriptorIndexing = dev.enabledFeatures.descriptorIndexing;
+    for (auto& ext : dev.requiredExtensions) {
+      if (ext == VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME) {
+        descriptorIndexing.pNext = const_cast<void*>(dCreateInfo.pNext);
+        dCreateInfo.pNext = &descriptorIndexing;
+        break;
+      }
+    }
+#endif /* VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME */
+#ifdef VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+    // Copy timelineSemaphore to chain it without modifying enabledFeatures.
+    auto timelineSemaphore = dev.enabledFeatures.timelineSemaphore;
+    if (timelineSemaphore.timelineSemaphore) {
+      timelineSemaphore.pNext = const_cast<void*>(dCreateInfo.pNext);
+      dCreateInfo.pNext = &timelineSemaphore;
+    }
+#endif /* VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME */
     std::vector<const char*> reqPtrs;
     if (dev.requiredExtensions.size()) {
       dCreateInfo.enabledExtensionCount = dev.requiredExtensions.size();
@@ -252,6 +293,10 @@ int Instance::open(VkExtent2D surfaceSizeRequest) {
       logE("vkCreateDevice then dev.setName failed\n");
       return 1;
     }
+    if (dev.loadPipelineCache("")) {
+      logE("vkCreateDevice then dev.loadPipelineCache failed\n");
+      return 1;
+    }
   }
 
   // vkGetDeviceQueue returns the created queues - fill in dev.qfams.
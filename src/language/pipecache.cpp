@@ -0,0 +1,138 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ * This file implements Device::loadPipelineCache and savePipelineCache.
+ */
+#include <errno.h>
+
+#include "language.h"
+
+namespace language {
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+// readFile reads all of filename into out. A missing file returns 0 with out
+// empty.
+int readFile(const std::string& filename, std::vector<char>& out) {
+  out.clear();
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (!f) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    logE("loadPipelineCache: fopen(%s) failed: %d %s\n", filename.c_str(),
+         errno, strerror(errno));
+    return 1;
+  }
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out.insert(out.end(), buf, buf + n);
+  }
+  if (ferror(f)) {
+    logE("loadPipelineCache: fread(%s) failed: %d %s\n", filename.c_str(),
+         errno, strerror(errno));
+    fclose(f);
+    return 1;
+  }
+  fclose(f);
+  return 0;
+}
+
+// isHeaderValid checks the VkPipelineCacheHeaderVersionOne at the start of
+// data against dev. A cache from a different device or driver is useless.
+bool isHeaderValid(Device& dev, const std::vector<char>& data) {
+  // The header is defined in the Vulkan spec as 16 bytes + VK_UUID_SIZE.
+  uint32_t h[4];
+  if (data.size() < sizeof(h) + VK_UUID_SIZE) {
+    return false;
+  }
+  memcpy(h, data.data(), sizeof(h));
+  auto& props = dev.physProp.properties;
+  if (h[0] < sizeof(h) + VK_UUID_SIZE || h[0] > data.size() ||
+      h[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE || h[2] != props.vendorID ||
+      h[3] != props.deviceID) {
+    return false;
+  }
+  return !memcmp(data.data() + sizeof(h), props.pipelineCacheUUID,
+                 VK_UUID_SIZE);
+}
+
+}  // anonymous namespace
+
+int Device::loadPipelineCache(const std::string& dir) {
+  std::vector<char> data;
+  pipelineCacheFile.clear();
+  if (!dir.empty()) {
+    auto& props = physProp.properties;
+    char name[256];
+    int n = snprintf(name, sizeof(name), "%cpipeline-%08x-%08x-%08x-",
+                     OS_SEPARATOR, props.vendorID, props.deviceID,
+                     props.driverVersion);
+    for (size_t i = 0; i < VK_UUID_SIZE && n > 0 && (size_t)n < sizeof(name);
+         i++) {
+      n += snprintf(name + n, sizeof(name) - n, "%02x",
+                    props.pipelineCacheUUID[i]);
+    }
+    pipelineCacheFile = dir + name + ".cache";
+    if (readFile(pipelineCacheFile, data)) {
+      logE("loadPipelineCache(%s) failed\n", pipelineCacheFile.c_str());
+      return 1;
+    }
+    if (!data.empty() && !isHeaderValid(*this, data)) {
+      logW("loadPipelineCache(%s): header mismatch, ignored\n",
+           pipelineCacheFile.c_str());
+      data.clear();
+    }
+  }
+
+  VkPipelineCacheCreateInfo info;
+  memset(&info, 0, sizeof(info));
+  info.sType = autoSType(info);
+  info.initialDataSize = data.size();
+  info.pInitialData = data.empty() ? nullptr : data.data();
+
+  pipelineCache.reset();
+  VkResult v = vkCreatePipelineCache(dev, &info, dev.allocator, &pipelineCache);
+  if (v != VK_SUCCESS && !data.empty()) {
+    // The driver rejected the data. Start over with an empty cache.
+    logW("loadPipelineCache(%s): rejected by driver, ignored\n",
+         pipelineCacheFile.c_str());
+    info.initialDataSize = 0;
+    info.pInitialData = nullptr;
+    v = vkCreatePipelineCache(dev, &info, dev.allocator, &pipelineCache);
+  }
+  if (v != VK_SUCCESS) {
+    return explainVkResult("vkCreatePipelineCache", v);
+  }
+  pipelineCache.allocator = dev.allocator;
+  pipelineCache.onCreate();
+  return 0;
+}
+
+int Device::savePipelineCache() {
+  if (pipelineCacheFile.empty()) {
+    logE("savePipelineCache: call loadPipelineCache(dir) first\n");
+    return 1;
+  }
+  if (!pipelineCache) {
+    logE("savePipelineCache: pipelineCache is NULL\n");
+    return 1;
+  }
+  size_t len = 0;
+  VkResult v = vkGetPipelineCacheData(dev, pipelineCache, &len, nullptr);
+  if (v != VK_SUCCESS) {
+    return explainVkResult("vkGetPipelineCacheData", v);
+  }
+  std::vector<char> data(len);
+  v = vkGetPipelineCacheData(dev, pipelineCache, &len, data.data());
+  if (v != VK_SUCCESS) {
+    return explainVkResult("vkGetPipelineCacheData", v);
+  }
+  data.resize(len);
+  if (writeFileAtomic(pipelineCacheFile.c_str(), data.data(), data.size())) {
+    logE("savePipelineCache(%s) failed\n", pipelineCacheFile.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace language
@@ -1,5 +1,9 @@
 /* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
  */
+#include <errno.h>
+
+#include <algorithm>
+
 #include "memory.h"
 
 namespace memory {
@@ -12,6 +16,8 @@ int DescriptorPool::ctorError(
     if (last.sets.size() < last.maxSets) {
       return 0;
     }
+  } else if (hints) {
+    maxSets = std::max(maxSets, hints->get(sizes));
   }
 
   vk.emplace_back(dev, maxSets, flags);
@@ -44,6 +50,7 @@ int DescriptorPool::ctorError(
 }
 
 int DescriptorPool::alloc(VkDescriptorSet& out, VkDescriptorSetLayout layout) {
+  std::lock_guard<std::mutex> lock(*lockmutex);
   if (vk.empty()) {
     // Call ctorError to make a pool.
     if (ctorError()) {
@@ -116,10 +123,15 @@ int DescriptorPool::alloc(VkDescriptorSet& out, VkDescriptorSetLayout layout) {
     }
     break;
   }
+  inUse++;
+  if (hints) {
+    hints->observe(sizes, inUse);
+  }
   return 0;
 }
 
 void DescriptorPool::free(VkDescriptorSet ds) {
+  std::lock_guard<std::mutex> lock(*lockmutex);
   void* dsPtr = static_cast<void*>(ds);
   for (size_t i = vk.size(); i;) {
     i--;
@@ -139,6 +151,7 @@ void DescriptorPool::free(VkDescriptorSet ds) {
         exit(1);
       }
       sets.erase(f);
+      inUse--;
       return;
     }
   }
@@ -146,6 +159,107 @@ void DescriptorPool::free(VkDescriptorSet ds) {
   exit(1);
 }
 
+// hintsMagic is the first line of a DescriptorPoolHints file. Each line after
+// it is: maxSets type=count type=count ...
+static const char hintsMagic[] = "volcano DescriptorPoolHints v1";
+
+int DescriptorPoolHints::load(const char* filename) {
+  FILE* f = fopen(filename, "r");
+  if (!f) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    logE("DescriptorPoolHints::load: fopen(%s) failed: %d %s\n", filename,
+         errno, strerror(errno));
+    return 1;
+  }
+  std::map<DescriptorPoolSizes, size_t> loaded;
+  char line[4096];
+  bool magicOk = fgets(line, sizeof(line), f) &&
+                 !strncmp(line, hintsMagic, sizeof(hintsMagic) - 1);
+  while (magicOk && fgets(line, sizeof(line), f)) {
+    char* p = line;
+    char* end;
+    unsigned long long n = strtoull(p, &end, 10);
+    if (end == p) {
+      continue;  // Skip empty or malformed lines.
+    }
+    DescriptorPoolSizes sizes;
+    for (p = end; *p == ' ';) {
+      p++;
+      unsigned long type = strtoul(p, &end, 10);
+      if (end == p || *end != '=') {
+        break;
+      }
+      p = end + 1;
+      unsigned long count = strtoul(p, &end, 10);
+      if (end == p) {
+        break;
+      }
+      p = end;
+      VkDescriptorPoolSize s;
+      s.type = (VkDescriptorType)type;
+      s.descriptorCount = count;
+      sizes[s.type] = s;
+    }
+    if (sizes.empty() || (*p != '\n' && *p != '\r' && *p)) {
+      logW("DescriptorPoolHints::load(%s): ignoring line \"%s\"\n", filename,
+           line);
+      continue;
+    }
+    loaded[sizes] = (size_t)n;
+  }
+  fclose(f);
+  if (!magicOk) {
+    logW("DescriptorPoolHints::load(%s): not a hints file, ignored\n",
+         filename);
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(lockmutex);
+  for (auto& i : loaded) {
+    size_t& p = peak[i.first];
+    p = std::max(p, i.second);
+  }
+  return 0;
+}
+
+int DescriptorPoolHints::save(const char* filename) {
+  std::string out(hintsMagic);
+  out += '\n';
+  {
+    std::lock_guard<std::mutex> lock(lockmutex);
+    for (auto& i : peak) {
+      out += std::to_string(i.second);
+      for (auto& s : i.first) {
+        out += ' ';
+        out += std::to_string((unsigned)s.second.type);
+        out += '=';
+        out += std::to_string((unsigned)s.second.descriptorCount);
+      }
+      out += '\n';
+    }
+  }
+  if (writeFileAtomic(filename, out.data(), out.size())) {
+    logE("DescriptorPoolHints::save(%s) failed\n", filename);
+    return 1;
+  }
+  return 0;
+}
+
+size_t DescriptorPoolHints::get(const DescriptorPoolSizes& sizes) {
+  std::lock_guard<std::mutex> lock(lockmutex);
+  auto i = peak.find(sizes);
+  return (i == peak.end()) ? 0 : i->second;
+}
+
+void DescriptorPoolHints::observe(const DescriptorPoolSizes& sizes,
+                                  size_t inUse) {
+  std::lock_guard<std::mutex> lock(lockmutex);
+  size_t& p = peak[sizes];
+  p = std::max(p, inUse);
+}
+
 static const std::string DescriptorPoolGetNameEmptyError =
     "DescriptorPool::getName before ctorError is invalid";
 
@@ -160,6 +274,7 @@ int DescriptorSetLayout::ctorError(
     const std::vector<VkDescriptorSetLayoutBinding>& bindings) {
   // Save the descriptor types that make up this layout.
   sizes.clear();
+  args.clear();
   VkDescriptorPoolSize zeroSize;
   memset(&zeroSize, 0, sizeof(zeroSize));
   for (auto& binding : bindings) {
@@ -179,6 +294,26 @@ int DescriptorSetLayout::ctorError(
   info.sType = autoSType(info);
   info.bindingCount = bindings.size();
   info.pBindings = bindings.data();
+  info.flags = flags;
+
+  VkDescriptorSetLayoutBindingFlagsCreateInfoEXT flagsInfo;
+  if (!bindingFlags.empty()) {
+    if (bindingFlags.size() != bindings.size()) {
+      logE("DescriptorSetLayout::ctorError: bindingFlags.size=%zu, want %zu\n",
+           bindingFlags.size(), bindings.size());
+      return 1;
+    }
+    if (!vk.dev.isExtensionLoaded(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME)) {
+      logE("DescriptorSetLayout::ctorError: bindingFlags requires %s\n",
+           VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+      return 1;
+    }
+    memset(&flagsInfo, 0, sizeof(flagsInfo));
+    flagsInfo.sType = autoSType(flagsInfo);
+    flagsInfo.bindingCount = bindingFlags.size();
+    flagsInfo.pBindingFlags = bindingFlags.data();
+    info.pNext = &flagsInfo;
+  }
 
   if (vk.dev.apiVersionInUse() >= VK_MAKE_VERSION(1, 1, 0)) {
     // Check vkGetDescriptorSetLayoutSupport first, and spit out its hints.
@@ -230,7 +365,7 @@ int DescriptorSet::write(uint32_t binding,
          binding, "imageInfo", binding, args.size());
     return 1;
   }
-  if (!vk) {
+  if (!vk && !isPush) {
     logE("DescriptorSet::write(%u, %s): before ctorError\n", binding,
          "imageInfo");
     return 1;
@@ -255,7 +390,7 @@ int DescriptorSet::write(uint32_t binding,
   w.descriptorType = args.at(binding);
   w.descriptorCount = imageInfo.size();
   w.pImageInfo = imageInfo.data();
-  vkUpdateDescriptorSets(dev.dev, 1, &w, 0, nullptr);
+  update(w);
   return 0;
 }
 
@@ -267,7 +402,7 @@ int DescriptorSet::write(uint32_t binding,
          binding, "bufferInfo", binding, args.size());
     return 1;
   }
-  if (!vk) {
+  if (!vk && !isPush) {
     logE("DescriptorSet::write(%u, %s): before ctorError\n", binding,
          "bufferInfo");
     return 1;
@@ -307,7 +442,7 @@ int DescriptorSet::write(uint32_t binding,
   w.descriptorType = args.at(binding);
   w.descriptorCount = bufferInfo.size();
   w.pBufferInfo = bufferInfo.data();
-  vkUpdateDescriptorSets(dev.dev, 1, &w, 0, nullptr);
+  update(w);
   return 0;
 }
 
@@ -319,7 +454,7 @@ int DescriptorSet::write(uint32_t binding,
          binding, "VkBufferView", binding, args.size());
     return 1;
   }
-  if (!vk) {
+  if (!vk && !isPush) {
     logE("DescriptorSet::write(%u, %s): before ctorError\n", binding,
          "VkBufferView");
     return 1;
@@ -342,8 +477,64 @@ int DescriptorSet::write(uint32_t binding,
   w.descriptorType = args.at(binding);
   w.descriptorCount = texelBufferViewInfo.size();
   w.pTexelBufferView = texelBufferViewInfo.data();
-  vkUpdateDescriptorSets(dev.dev, 1, &w, 0, nullptr);
+  update(w);
   return 0;
 }
 
+void DescriptorSet::update(const VkWriteDescriptorSet& w) {
+  generation++;
+  if (!isPush) {
+    vkUpdateDescriptorSets(dev.dev, 1, &w, 0, nullptr);
+    return;
+  }
+  // Copy w and its arrays. A later write to the same (binding, arrayI)
+  // replaces the earlier one.
+  PushWrite& p = pushWrites[std::make_pair(w.dstBinding, w.dstArrayElement)];
+  p.w = w;
+  p.w.dstSet = VK_NULL_HANDLE;  // Ignored by vkCmdPushDescriptorSetKHR.
+  p.imageInfo.clear();
+  p.bufferInfo.clear();
+  p.texelBufferView.clear();
+  if (w.pImageInfo) {
+    p.imageInfo.assign(w.pImageInfo, w.pImageInfo + w.descriptorCount);
+  }
+  if (w.pBufferInfo) {
+    p.bufferInfo.assign(w.pBufferInfo, w.pBufferInfo + w.descriptorCount);
+  }
+  if (w.pTexelBufferView) {
+    p.texelBufferView.assign(w.pTexelBufferView,
+                             w.pTexelBufferView + w.descriptorCount);
+  }
+}
+
+int DescriptorSet::bind(command::CommandBuffer& cmd,
+                        VkPipelineBindPoint bindPoint, VkPipelineLayout layout,
+                        uint32_t setI) {
+  if (!isPush) {
+    if (!vk) {
+      logE("DescriptorSet::bind(set=%u): before ctorError\n", setI);
+      return 1;
+    }
+    return cmd.bindDescriptorSets(bindPoint, layout, setI, 1, &vk);
+  }
+  if (pushWrites.empty()) {
+    logE("DescriptorSet::bind(set=%u): push descriptor with no writes\n",
+         setI);
+    return 1;
+  }
+  std::vector<VkWriteDescriptorSet> writes;
+  writes.reserve(pushWrites.size());
+  for (auto& i : pushWrites) {
+    PushWrite& p = i.second;
+    writes.emplace_back(p.w);
+    auto& w = writes.back();
+    w.pImageInfo = p.imageInfo.empty() ? nullptr : p.imageInfo.data();
+    w.pBufferInfo = p.bufferInfo.empty() ? nullptr : p.bufferInfo.data();
+    w.pTexelBufferView =
+        p.texelBufferView.empty() ? nullptr : p.texelBufferView.data();
+  }
+  return cmd.pushDescriptorSet(bindPoint, layout, setI, writes.size(),
+                               writes.data());
+}
+
 }  // namespace memory
@@ -129,6 +129,7 @@ int Image::ctorError(VkMemoryPropertyFlags props) {
   vk.allocator = mem.dev.dev.allocator;
   vk.onCreate();
   currentLayout = info.initialLayout;
+  subLayout.clear();
 
 #ifdef VOLCANO_DISABLE_VULKANMEMORYALLOCATOR
   MemoryRequirements req(mem.dev, *this);
@@ -158,6 +159,7 @@ int Image::ctorError(VmaMemoryUsage usage) {
   vk.allocator = mem.dev.dev.allocator;
   vk.onCreate();
   currentLayout = info.initialLayout;
+  subLayout.clear();
   return mem.alloc({mem.dev, *this, usage}) || getSubresourceLayouts();
 }
 #endif /*VOLCANO_DISABLE_VULKANMEMORYALLOCATOR*/
@@ -246,19 +246,20 @@ int Image::makeTransitionAccessMasks(VkImageMemoryBarrier& imageB) {
   return 0;
 }
 
-VkImageMemoryBarrier Image::makeTransition(VkImageLayout newLayout) {
+VkImageMemoryBarrier Image::makeTransition(VkImageLayout oldLayout,
+                                           VkImageLayout newLayout) {
   VkImageMemoryBarrier imageB;
   memset(&imageB, 0, sizeof(imageB));
   imageB.sType = autoSType(imageB);
-  if (newLayout == currentLayout) {
-    logE("Image::makeTransition(from %d to %d) is no change!\n", currentLayout,
+  if (newLayout == oldLayout) {
+    logE("Image::makeTransition(from %d to %d) is no change!\n", oldLayout,
          newLayout);
     // Returning without setting imageB.image lets CommandBuffer::barrier()
     // know there was an error.
     return imageB;
   }
 
-  imageB.oldLayout = currentLayout;
+  imageB.oldLayout = oldLayout;
   imageB.newLayout = newLayout;
   imageB.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
   imageB.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
@@ -276,4 +277,115 @@ VkImageMemoryBarrier Image::makeTransition(VkImageLayout newLayout) {
   return imageB;
 }
 
+namespace {  // an anonymous namespace hides its contents outside this file
+
+// resolveRange replaces VK_REMAINING_MIP_LEVELS and VK_REMAINING_ARRAY_LAYERS
+// and checks that range is inside img.
+int resolveRange(const Image& img, VkImageSubresourceRange& range) {
+  if (range.levelCount == VK_REMAINING_MIP_LEVELS) {
+    range.levelCount = img.info.mipLevels - range.baseMipLevel;
+  }
+  if (range.layerCount == VK_REMAINING_ARRAY_LAYERS) {
+    range.layerCount = img.info.arrayLayers - range.baseArrayLayer;
+  }
+  if (range.baseMipLevel + range.levelCount > img.info.mipLevels ||
+      range.baseArrayLayer + range.layerCount > img.info.arrayLayers) {
+    logE("Image: range mip %u + %u layer %u + %u outside %u mips %u layers\n",
+         range.baseMipLevel, range.levelCount, range.baseArrayLayer,
+         range.layerCount, img.info.mipLevels, img.info.arrayLayers);
+    return 1;
+  }
+  return 0;
+}
+
+}  // anonymous namespace
+
+int Image::makeTransitions(VkImageLayout newLayout,
+                           const VkImageSubresourceRange& range_,
+                           std::vector<VkImageMemoryBarrier>& out) {
+  VkImageSubresourceRange range = range_;
+  if (resolveRange(*this, range)) {
+    return 1;
+  }
+  size_t first = out.size();
+  for (uint32_t layer = range.baseArrayLayer;
+       layer < range.baseArrayLayer + range.layerCount; layer++) {
+    // Find runs of mip levels in this layer that share the same oldLayout.
+    uint32_t mip = range.baseMipLevel;
+    uint32_t mipEnd = range.baseMipLevel + range.levelCount;
+    while (mip < mipEnd) {
+      VkImageLayout oldLayout = getLayout(mip, layer);
+      uint32_t runStart = mip;
+      while (mip < mipEnd && getLayout(mip, layer) == oldLayout) {
+        mip++;
+      }
+      if (oldLayout == newLayout) {
+        continue;
+      }
+      VkImageSubresourceRange sub = range;
+      sub.baseMipLevel = runStart;
+      sub.levelCount = mip - runStart;
+      sub.baseArrayLayer = layer;
+      sub.layerCount = 1;
+
+      // Extend a barrier from the previous layer if it is the same run.
+      bool merged = false;
+      for (size_t i = first; i < out.size(); i++) {
+        auto& prev = out.at(i);
+        auto& p = prev.subresourceRange;
+        if (prev.oldLayout == oldLayout && p.baseMipLevel == sub.baseMipLevel &&
+            p.levelCount == sub.levelCount &&
+            p.baseArrayLayer + p.layerCount == layer) {
+          p.layerCount++;
+          merged = true;
+          break;
+        }
+      }
+      if (merged) {
+        continue;
+      }
+      out.emplace_back(makeTransition(oldLayout, newLayout));
+      if (!out.back().image) {
+        logE("Image::makeTransitions: makeTransition failed\n");
+        return 1;
+      }
+      out.back().subresourceRange = sub;
+    }
+  }
+  return 0;
+}
+
+void Image::setLayout(const VkImageSubresourceRange& range_,
+                      VkImageLayout newLayout) {
+  VkImageSubresourceRange range = range_;
+  if (resolveRange(*this, range)) {
+    return;
+  }
+  if (range.baseMipLevel == 0 && range.levelCount == info.mipLevels &&
+      range.baseArrayLayer == 0 && range.layerCount == info.arrayLayers) {
+    subLayout.clear();
+    currentLayout = newLayout;
+    return;
+  }
+  if (subLayout.empty()) {
+    subLayout.assign(info.mipLevels * info.arrayLayers, currentLayout);
+  }
+  for (uint32_t layer = range.baseArrayLayer;
+       layer < range.baseArrayLayer + range.layerCount; layer++) {
+    for (uint32_t mip = range.baseMipLevel;
+         mip < range.baseMipLevel + range.levelCount; mip++) {
+      subLayout.at(layer * info.mipLevels + mip) = newLayout;
+    }
+  }
+  for (auto l : subLayout) {
+    if (l != newLayout) {
+      currentLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      return;
+    }
+  }
+  // The whole image is in newLayout now.
+  subLayout.clear();
+  currentLayout = newLayout;
+}
+
 }  // namespace memory
@@ -364,7 +364,45 @@ typedef struct Image {
 
   // makeTransition() makes a VkImageMemoryBarrier for commandBuffer::barrier()
   // Your app can use commandBuffer::barrier(), which will call this for you.
-  VkImageMemoryBarrier makeTransition(VkImageLayout newLayout);
+  VkImageMemoryBarrier makeTransition(VkImageLayout newLayout) {
+    return makeTransition(currentLayout, newLayout);
+  }
+
+  // makeTransition(oldLayout, newLayout) is for a subresource range that is
+  // in oldLayout, which may not be currentLayout.
+  VkImageMemoryBarrier makeTransition(VkImageLayout oldLayout,
+                                      VkImageLayout newLayout);
+
+  // makeTransitions() appends barriers to out for only the mip levels and
+  // array layers in range which are not already in newLayout. Each barrier
+  // uses the layout that part of the image is in, and adjacent subresources
+  // that are in the same layout share one barrier. It does not call
+  // setLayout(). Your app can use commandBuffer::barrier(), which will call
+  // this for you.
+  //
+  // Only layouts are tracked per subresource, not accesses: srcAccessMask is
+  // still derived from each old layout by makeTransitionAccessMasks(). If
+  // your app accessed a subresource in a way its layout does not imply (such
+  // as a shader write in VK_IMAGE_LAYOUT_GENERAL), fix up srcAccessMask.
+  WARN_UNUSED_RESULT int makeTransitions(
+      VkImageLayout newLayout, const VkImageSubresourceRange& range,
+      std::vector<VkImageMemoryBarrier>& out);
+
+  // hasMixedLayouts returns true if different mip levels or array layers are
+  // in different layouts. currentLayout is not valid in that case.
+  bool hasMixedLayouts() const { return !subLayout.empty(); }
+
+  // getLayout returns the layout of one mip level and array layer.
+  VkImageLayout getLayout(uint32_t mipLevel, uint32_t arrayLayer = 0) const {
+    if (subLayout.empty()) {
+      return currentLayout;
+    }
+    return subLayout.at(arrayLayer * info.mipLevels + mipLevel);
+  }
+
+  // setLayout records that range is now in newLayout. If that leaves the
+  // whole image in one layout, subLayout is cleared and currentLayout is set.
+  void setLayout(const VkImageSubresourceRange& range, VkImageLayout newLayout);
 
   // getAllAspects computes VkImageAspectFlags purely as a function of
   // info.format.
@@ -414,7 +452,17 @@ typedef struct Image {
   const std::string& getName() const { return vk.getName(); }
 
   VkImageCreateInfo info;
+  // currentLayout is the layout of the whole image. If different mip levels or
+  // array layers are in different layouts, hasMixedLayouts() is true,
+  // currentLayout is not meaningful (it holds VK_IMAGE_LAYOUT_UNDEFINED) and
+  // subLayout has the layout of each one. Check hasMixedLayouts() first.
   VkImageLayout currentLayout;
+  // subLayout is empty unless different subresources are in different
+  // layouts. Use getLayout() instead of reading subLayout directly. If your
+  // app writes to currentLayout, it must also clear subLayout.
+  // subLayout is indexed by arrayLayer * info.mipLevels + mipLevel. There is
+  // no matching per-subresource access tracking (see makeTransitions()).
+  std::vector<VkImageLayout> subLayout;
   VkDebugPtr<VkImage> vk;  // populated after ctorError().
   DeviceMemory mem;        // ctorError() calls mem.alloc() for you.
 #ifndef VOLCANO_DISABLE_VULKANMEMORYALLOCATOR
@@ -423,6 +423,15 @@ typedef struct DescriptorSetLayout {
   // getName forwards the getName call to vk.
   const std::string& getName() const { return vk.getName(); }
 
+  // flags is passed to VkDescriptorSetLayoutCreateInfo::flags. Set it before
+  // calling ctorError (e.g. UPDATE_AFTER_BIND_POOL_BIT_EXT).
+  VkDescriptorSetLayoutCreateFlags flags{0};
+  // bindingFlags, if not empty, is chained in a
+  // VkDescriptorSetLayoutBindingFlagsCreateInfoEXT. It must then have the
+  // same number of elements as bindings passed to ctorError. Requires
+  // VK_EXT_descriptor_indexing.
+  std::vector<VkDescriptorBindingFlagsEXT> bindingFlags;
+
   DescriptorPoolSizes sizes;
   std::vector<VkDescriptorType> args;
   VkDebugPtr<VkDescriptorSetLayout> vk;
@@ -448,6 +457,31 @@ typedef struct DescriptorPoolAllocator {
   VkDebugPtr<VkDescriptorPool> vk;
 } DescriptorPoolAllocator;
 
+// DescriptorPoolHints records the peak number of DescriptorSet objects
+// allocated for each DescriptorPoolSizes. Save it to a file when your app
+// exits, then load it on the next run. Each DescriptorPool with the same
+// hints then starts out large enough, instead of growing during warm-up.
+//
+// DescriptorPoolHints is thread-safe.
+typedef struct DescriptorPoolHints {
+  // load reads hints saved by save(). A missing file is not an error: the
+  // hints are just empty.
+  WARN_UNUSED_RESULT int load(const char* filename);
+
+  // save writes all hints to filename (atomically).
+  WARN_UNUSED_RESULT int save(const char* filename);
+
+  // get returns the hint for sizes, or 0 if there is no hint.
+  size_t get(const DescriptorPoolSizes& sizes);
+
+  // observe records inUse if it is a new peak for sizes.
+  void observe(const DescriptorPoolSizes& sizes, size_t inUse);
+
+ protected:
+  std::mutex lockmutex;
+  std::map<DescriptorPoolSizes, size_t> peak;
+} DescriptorPoolHints;
+
 // DescriptorPool is the allocator that creates DescriptorSet objects for your
 // app.
 //
@@ -468,7 +502,8 @@ typedef struct DescriptorPool {
   DescriptorPool(const DescriptorPool&) = delete;
 
   // ctorError calls vkCreateDescriptorPool. If you want to increase the
-  // initial allocation, modify maxSets before calling ctorError().
+  // initial allocation, modify maxSets before calling ctorError(), or set
+  // hints.
   //
   // If VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT is not set (in the
   // flags argument), all VkDescriptorSet objects are allocated immediately in
@@ -489,6 +524,7 @@ typedef struct DescriptorPool {
   // any DescriptorSet objects your app still holds. Your app must set the
   // DescriptorSet::vk member to VK_NULL_HANDLE in each object.
   WARN_UNUSED_RESULT int reset() {
+    std::lock_guard<std::mutex> lock(*lockmutex);
     for (size_t i = 0; i < vk.size(); i++) {
       VkResult v =
           vkResetDescriptorPool(dev.dev, vk.at(i).vk, 0 /*flags is reserved*/);
@@ -497,6 +533,7 @@ typedef struct DescriptorPool {
       }
       vk.at(i).sets.clear();
     }
+    inUse = 0;
     return 0;
   }
 
@@ -538,9 +575,20 @@ typedef struct DescriptorPool {
   // Your app can increase the initial allocation before calling ctorError().
   size_t maxSets{DescriptorPool::INITIAL_MAXSETS};
 
+  // hints, if set before ctorError(), raises the initial maxSets to the peak
+  // seen before, and records the peak of this pool.
+  std::shared_ptr<DescriptorPoolHints> hints;
+  // inUse is the number of VkDescriptorSet objects currently allocated.
+  size_t inUse{0};
+
   language::Device& dev;
   const DescriptorPoolSizes sizes;
   std::vector<DescriptorPoolAllocator> vk;
+
+  // lockmutex serializes alloc() and free(), since a DescriptorSet may be
+  // destroyed on a different thread than the one that allocated it. It is
+  // a shared_ptr so DescriptorPool is still movable.
+  std::shared_ptr<std::mutex> lockmutex{std::make_shared<std::mutex>()};
 } DescriptorPool;
 
 // DescriptorSet represents a set of bindings (which represent inputs or
@@ -563,10 +611,21 @@ typedef struct DescriptorPool {
 //    a RenderPass to pass in inputs and receive outputs of the shader.
 //    Note: the 'uint32_t binding' is confusingly named: it is just the
 //    argument number of the input or output.
+//
+// If layout has VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR set in
+// DescriptorSetLayout::flags then vk is VK_NULL_HANDLE. write() only records
+// the writes, and bind() pushes them into the command buffer with
+// vkCmdPushDescriptorSetKHR.
 typedef struct DescriptorSet {
   DescriptorSet(language::Device& dev, DescriptorPool& parent,
                 DescriptorSetLayout& layout, VkDescriptorSet vk)
-      : dev(dev), parent(parent), args(layout.args), vk(vk) {}
+      : dev(dev),
+        parent(parent),
+        args(layout.args),
+        vk(vk),
+        isPush((layout.flags &
+                VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR) != 0) {
+  }
   ~DescriptorSet();
 
   // write populates the DescriptorSet with type and image.
@@ -599,6 +658,12 @@ typedef struct DescriptorSet {
     return write(binding, imageInfo, arrayI);
   }
 
+  // bind binds this DescriptorSet at set = setI. If isPush, bind instead
+  // pushes all the writes recorded so far into cmd.
+  WARN_UNUSED_RESULT int bind(command::CommandBuffer& cmd,
+                              VkPipelineBindPoint bindPoint,
+                              VkPipelineLayout layout, uint32_t setI);
+
   // setName calls setObjectName for the DescriptorSet.
   WARN_UNUSED_RESULT int setName(const std::string& name) {
     this->name = name;
@@ -623,8 +688,26 @@ typedef struct DescriptorSet {
   // vk is the raw VkDescriptorSet handle, no VkPtr<> or VkDebugPtr<>,
   // because it does not have a destroy_fn that matches the VkPtr<> template.
   VkDescriptorSet vk;
+  // isPush is true if the layout is a push descriptor layout.
+  const bool isPush;
+  // generation is incremented by each write(). A write to a bound set
+  // (without UPDATE_AFTER_BIND) invalidates any command buffer it is bound in.
+  uint64_t generation{0};
 
  protected:
+  // update calls vkUpdateDescriptorSets, or if isPush saves w in pushWrites.
+  void update(const VkWriteDescriptorSet& w);
+
+  // PushWrite holds a copy of a VkWriteDescriptorSet and its arrays.
+  struct PushWrite {
+    VkWriteDescriptorSet w;
+    std::vector<VkDescriptorImageInfo> imageInfo;
+    std::vector<VkDescriptorBufferInfo> bufferInfo;
+    std::vector<VkBufferView> texelBufferView;
+  };
+  // pushWrites is indexed by (binding, arrayI).
+  std::map<std::pair<uint32_t, uint32_t>, PushWrite> pushWrites;
+
   // name is automatically set using VkDebugUtilsObjectNameInfoEXT
   // (or fallback to vkDebugMarkerSetObjectNameEXT())
   std::string name;
@@ -8,6 +8,10 @@
 namespace command {
 
 int CommandBuffer::barrier(memory::Image& img, VkImageLayout newLayout) {
+  if (img.hasMixedLayouts()) {
+    // Parts of img are in different layouts. Only transition what is needed.
+    return barrier(img, newLayout, img.getSubresourceRange());
+  }
   if (img.currentLayout == newLayout) {
     // Silently discard no-op transitions.
     return 0;
@@ -23,8 +27,17 @@ int CommandBuffer::barrier(memory::Image& img, VkImageLayout newLayout) {
 int CommandBuffer::barrier(memory::Image& img, VkImageLayout newLayout,
                            const VkImageSubresourceRange& range) {
   CommandPool::lock_guard_t lock(cpool.lockmutex);
-  lazyBarriers.img.emplace_back(img.makeTransition(newLayout));
-  lazyBarriers.img.back().subresourceRange = range;
+  size_t before = lazyBarriers.img.size();
+  if (img.makeTransitions(newLayout, range, lazyBarriers.img)) {
+    logE("CommandBuffer::barrier: makeTransitions failed\n");
+    lazyBarriers.img.resize(before);
+    return 1;
+  }
+  img.setLayout(range, newLayout);
+  if (lazyBarriers.img.size() == before) {
+    // Silently discard no-op transitions.
+    return 0;
+  }
   // FIXME: Bug workaround for validation layers: if 'range' and the very next
   // barrier use the same image and the next barrier affects the full image,
   // validation fails to record this barrier. Force all 'range' barriers to
@@ -32,31 +45,76 @@ int CommandBuffer::barrier(memory::Image& img, VkImageLayout newLayout,
   return flushLazyBarriers(lock);
 }
 
+int CommandBuffer::splitBarrier(memory::Image& img, VkImageLayout newLayout,
+                                BarrierSet& b) {
+  size_t before = b.img.size();
+  auto range = img.getSubresourceRange();
+  if (img.makeTransitions(newLayout, range, b.img)) {
+    logE("splitBarrier: makeTransitions failed\n");
+    b.img.resize(before);
+    return 1;
+  }
+  img.setLayout(range, newLayout);
+  return 0;
+}
+
 int CommandBuffer::copyImage(memory::Image& src, memory::Image& dst,
                              const std::vector<VkImageCopy>& regions) {
+  if (src.hasMixedLayouts()) {
+    logE("copyImage: src has mixed layouts, use the VkImage overload\n");
+    return 1;
+  }
+  if (dst.hasMixedLayouts()) {
+    logE("copyImage: dst has mixed layouts, use the VkImage overload\n");
+    return 1;
+  }
   return copyImage(src.vk, src.currentLayout, dst.vk, dst.currentLayout,
                    regions);
 }
 
 int CommandBuffer::copyImage(memory::Buffer& src, memory::Image& dst,
                              const std::vector<VkBufferImageCopy>& regions) {
+  if (dst.hasMixedLayouts()) {
+    logE("copyImage: dst has mixed layouts, use the VkImage overload\n");
+    return 1;
+  }
   return copyBufferToImage(src.vk, dst.vk, dst.currentLayout, regions);
 }
 
 int CommandBuffer::copyImage(memory::Image& src, memory::Buffer& dst,
                              const std::vector<VkBufferImageCopy>& regions) {
+  if (src.hasMixedLayouts()) {
+    logE("copyImage: src has mixed layouts, use the VkImage overload\n");
+    return 1;
+  }
   return copyImageToBuffer(src.vk, src.currentLayout, dst.vk, regions);
 }
 
 int CommandBuffer::blitImage(memory::Image& src, memory::Image& dst,
                              const std::vector<VkImageBlit>& regions,
                              VkFilter filter /*= VK_FILTER_LINEAR*/) {
+  if (src.hasMixedLayouts()) {
+    logE("blitImage: src has mixed layouts, use the VkImage overload\n");
+    return 1;
+  }
+  if (dst.hasMixedLayouts()) {
+    logE("blitImage: dst has mixed layouts, use the VkImage overload\n");
+    return 1;
+  }
   return blitImage(src.vk, src.currentLayout, dst.vk, dst.currentLayout,
                    regions, filter);
 }
 
 int CommandBuffer::resolveImage(memory::Image& src, memory::Image& dst,
                                 const std::vector<VkImageResolve>& regions) {
+  if (src.hasMixedLayouts()) {
+    logE("resolveImage: src has mixed layouts, use the VkImage overload\n");
+    return 1;
+  }
+  if (dst.hasMixedLayouts()) {
+    logE("resolveImage: dst has mixed layouts, use the VkImage overload\n");
+    return 1;
+  }
   return resolveImage(src.vk, src.currentLayout, dst.vk, dst.currentLayout,
                       regions);
 }
@@ -0,0 +1,206 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ *
+ * BindlessTable uses VK_EXT_descriptor_indexing to hold every image and
+ * buffer in a single DescriptorSet.
+ */
+#include <algorithm>
+
+#include "science.h"
+
+namespace science {
+
+int BindlessTable::SlotAllocator::alloc(uint32_t& slot) {
+  if (!freeList.empty()) {
+    slot = freeList.back();
+    freeList.pop_back();
+  } else if (next < max) {
+    slot = next;
+    next++;
+  } else {
+    logE("BindlessTable: all %u slots are in use\n", max);
+    return 1;
+  }
+  if (used.size() < next) {
+    used.resize(next, false);
+  }
+  used.at(slot) = true;
+  return 0;
+}
+
+int BindlessTable::SlotAllocator::free(uint32_t slot) {
+  if (slot >= used.size() || !used.at(slot)) {
+    logE("BindlessTable: free(%u) not allocated\n", slot);
+    return 1;
+  }
+  used.at(slot) = false;
+  freeList.emplace_back(slot);
+  return 0;
+}
+
+int BindlessTable::ctorLayout(memory::DescriptorSetLayout& out) {
+  std::vector<VkDescriptorSetLayoutBinding> bindings(2);
+  memset(bindings.data(), 0, sizeof(bindings[0]) * bindings.size());
+  bindings.at(imageBinding).binding = imageBinding;
+  bindings.at(imageBinding).descriptorType =
+      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings.at(imageBinding).descriptorCount = maxImages;
+  bindings.at(imageBinding).stageFlags = stageFlags;
+  bindings.at(bufferBinding).binding = bufferBinding;
+  bindings.at(bufferBinding).descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  bindings.at(bufferBinding).descriptorCount = maxBuffers;
+  bindings.at(bufferBinding).stageFlags = stageFlags;
+
+  out.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+  out.bindingFlags.clear();
+  out.bindingFlags.resize(bindings.size(),
+                          VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT |
+                              VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT);
+  if (out.ctorError(bindings)) {
+    logE("BindlessTable::ctorLayout: DescriptorSetLayout::ctorError failed\n");
+    return 1;
+  }
+  return 0;
+}
+
+int BindlessTable::ctorError() {
+  if (!dev.isExtensionLoaded(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME)) {
+    logE("BindlessTable::ctorError: %s not loaded\n",
+         VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+    return 1;
+  }
+  auto& feat = dev.enabledFeatures.descriptorIndexing;
+  if (!feat.descriptorBindingPartiallyBound ||
+      !feat.descriptorBindingSampledImageUpdateAfterBind ||
+      !feat.descriptorBindingStorageBufferUpdateAfterBind) {
+    logE("BindlessTable::ctorError: descriptorIndexing features missing:\n");
+    logE("    descriptorBindingPartiallyBound = %u\n",
+         (unsigned)feat.descriptorBindingPartiallyBound);
+    logE("    descriptorBindingSampledImageUpdateAfterBind = %u\n",
+         (unsigned)feat.descriptorBindingSampledImageUpdateAfterBind);
+    logE("    descriptorBindingStorageBufferUpdateAfterBind = %u\n",
+         (unsigned)feat.descriptorBindingStorageBufferUpdateAfterBind);
+    return 1;
+  }
+
+  // Clamp maxImages and maxBuffers to the device limits.
+  auto& lim = dev.physProp.descriptorIndexing;
+  maxImages = std::min(
+      maxImages,
+      std::min(lim.maxDescriptorSetUpdateAfterBindSampledImages,
+               lim.maxPerStageDescriptorUpdateAfterBindSampledImages));
+  maxImages = std::min(
+      maxImages, std::min(lim.maxDescriptorSetUpdateAfterBindSamplers,
+                          lim.maxPerStageDescriptorUpdateAfterBindSamplers));
+  maxBuffers = std::min(
+      maxBuffers,
+      std::min(lim.maxDescriptorSetUpdateAfterBindStorageBuffers,
+               lim.maxPerStageDescriptorUpdateAfterBindStorageBuffers));
+  if (!maxImages || !maxBuffers) {
+    logE("BindlessTable::ctorError: maxImages=%u maxBuffers=%u\n", maxImages,
+         maxBuffers);
+    return 1;
+  }
+
+  if (ctorLayout(layout)) {
+    logE("BindlessTable::ctorError: ctorLayout failed\n");
+    return 1;
+  }
+
+  ds.reset();
+  pool = std::make_shared<memory::DescriptorPool>(dev, layout.sizes);
+  pool->maxSets = 1;
+  if (pool->ctorError(VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT |
+                      VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT)) {
+    logE("BindlessTable::ctorError: pool.ctorError failed\n");
+    return 1;
+  }
+  VkDescriptorSet vk;
+  if (pool->alloc(vk, layout)) {
+    logE("BindlessTable::ctorError: pool.alloc failed\n");
+    return 1;
+  }
+  // TODO: when c++14 is used, use make_unique() here.
+  ds = std::unique_ptr<memory::DescriptorSet>(
+      new memory::DescriptorSet(dev, *pool, layout, vk));
+
+  std::lock_guard<std::mutex> lock(lockmutex);
+  images = SlotAllocator();
+  images.max = maxImages;
+  buffers = SlotAllocator();
+  buffers.max = maxBuffers;
+  return setName(debugName);
+}
+
+int BindlessTable::allocImage(const VkDescriptorImageInfo& imageInfo,
+                              uint32_t& slot) {
+  if (!ds) {
+    logE("BindlessTable::allocImage before ctorError\n");
+    return 1;
+  }
+  std::lock_guard<std::mutex> lock(lockmutex);
+  if (images.alloc(slot)) {
+    logE("BindlessTable::allocImage: out of slots\n");
+    return 1;
+  }
+  return ds->write(imageBinding, {imageInfo}, slot);
+}
+
+int BindlessTable::allocBuffer(const VkDescriptorBufferInfo& bufferInfo,
+                               uint32_t& slot) {
+  if (!ds) {
+    logE("BindlessTable::allocBuffer before ctorError\n");
+    return 1;
+  }
+  std::lock_guard<std::mutex> lock(lockmutex);
+  if (buffers.alloc(slot)) {
+    logE("BindlessTable::allocBuffer: out of slots\n");
+    return 1;
+  }
+  return ds->write(bufferBinding, {bufferInfo}, slot);
+}
+
+int BindlessTable::writeImage(uint32_t slot,
+                              const VkDescriptorImageInfo& imageInfo) {
+  std::lock_guard<std::mutex> lock(lockmutex);
+  if (!ds || slot >= images.used.size() || !images.used.at(slot)) {
+    logE("BindlessTable::writeImage(%u): slot not allocated\n", slot);
+    return 1;
+  }
+  return ds->write(imageBinding, {imageInfo}, slot);
+}
+
+int BindlessTable::writeBuffer(uint32_t slot,
+                               const VkDescriptorBufferInfo& bufferInfo) {
+  std::lock_guard<std::mutex> lock(lockmutex);
+  if (!ds || slot >= buffers.used.size() || !buffers.used.at(slot)) {
+    logE("BindlessTable::writeBuffer(%u): slot not allocated\n", slot);
+    return 1;
+  }
+  return ds->write(bufferBinding, {bufferInfo}, slot);
+}
+
+int BindlessTable::freeImage(uint32_t slot) {
+  std::lock_guard<std::mutex> lock(lockmutex);
+  return images.free(slot);
+}
+
+int BindlessTable::freeBuffer(uint32_t slot) {
+  std::lock_guard<std::mutex> lock(lockmutex);
+  return buffers.free(slot);
+}
+
+int BindlessTable::setName(const std::string& name) {
+  debugName = name;
+  if (!ds) {
+    // ctorError will set the name.
+    return 0;
+  }
+  if (layout.setName(name + ".layout") || pool->setName(name + ".pool") ||
+      ds->setName(name)) {
+    logE("BindlessTable::setName(%s) failed\n", name.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace science
@@ -26,7 +26,7 @@ int ComputePipeline::allocBlocks(size_t minSize) {
 }
 
 int ComputePipeline::ctorError() {
-  if (!shader || shader->bytes.empty()) {
+  if (!shader || !shader->vk) {
     logE("must call shader->loadSPV before ComputePipeline::ctorError\n");
     return 1;
   }
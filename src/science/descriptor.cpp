@@ -1,5 +1,6 @@
 /* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
  */
+#include <atomic>
 #include <map>
 
 #include "reflect.h"
@@ -8,6 +9,53 @@ using namespace std;
 
 namespace science {
 
+namespace {  // an anonymous namespace hides its contents outside this file
+
+// nextLibraryId gives each DescriptorLibrary a unique DescriptorLibrary::id.
+atomic<uint64_t> nextLibraryId{1};
+
+// threadPools finds the ThreadPools for a DescriptorLibrary::id without
+// taking any lock. It holds a weak_ptr: the DescriptorLibrary owns the pools.
+thread_local map<uint64_t, weak_ptr<DescriptorLibrary::ThreadPools>>
+    threadPools;
+
+}  // anonymous namespace
+
+DescriptorLibrary::DescriptorLibrary(language::Device& dev)
+    : dev(dev),
+      id(nextLibraryId++),
+      pushParent(dev, memory::DescriptorPoolSizes()) {}
+
+// canPush checks whether bindings can be a push descriptor set layout.
+static bool canPush(language::Device& dev,
+                    const vector<VkDescriptorSetLayoutBinding>& bindings) {
+  if (!dev.isExtensionLoaded(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME) ||
+      !dev.fp.pushDescriptorSet) {
+    logW("finalizeDescriptorLibrary: %s not loaded, pushSetI ignored\n",
+         VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+    return false;
+  }
+  size_t total = 0;
+  for (auto& b : bindings) {
+    switch (b.descriptorType) {
+      case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
+      case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
+        logW("finalizeDescriptorLibrary: pushSetI has %s, ignored\n",
+             string_VkDescriptorType(b.descriptorType));
+        return false;
+      default:
+        break;
+    }
+    total += b.descriptorCount;
+  }
+  if (total > dev.physProp.pushDescriptor.maxPushDescriptors) {
+    logW("finalizeDescriptorLibrary: pushSetI has %zu > %zu descriptors\n",
+         total, (size_t)dev.physProp.pushDescriptor.maxPushDescriptors);
+    return false;
+  }
+  return true;
+}
+
 int ShaderLibrary::addDynamic(size_t setI, size_t layoutI, uint32_t binding) {
   if (!_i) {
     logE("ShaderLibrary::addDynamic() before add()\n");
@@ -51,29 +99,75 @@ int ShaderLibrary::addDynamic(size_t setI, size_t layoutI, uint32_t binding) {
 }
 
 int ShaderLibrary::finalizeDescriptorLibrary(
-    DescriptorLibrary& descriptorLibrary) {
-  if (!descriptorLibrary.pool.empty()) {
+    DescriptorLibrary& descriptorLibrary,
+    size_t pushSetI /*= DescriptorLibrary::NO_PUSH_SET*/) {
+  if (descriptorLibrary.isFinalized()) {
     logE("finalizeDescriptorLibrary can only be performed once per object.\n");
     return 1;
   }
   const vector<vector<ShaderBinding>>& allSrcBindings = getBindings();
 
+  // Every layoutI must be able to use a push descriptor at pushSetI.
+  if (pushSetI != DescriptorLibrary::NO_PUSH_SET) {
+    if (descriptorLibrary.bindless &&
+        pushSetI == descriptorLibrary.bindless->setI) {
+      logE("finalizeDescriptorLibrary: pushSetI=%zu is bindless\n", pushSetI);
+      return 1;
+    }
+    for (auto& srcBindings : allSrcBindings) {
+      if (pushSetI < srcBindings.size() &&
+          !canPush(dev, srcBindings.at(pushSetI).layouts)) {
+        pushSetI = DescriptorLibrary::NO_PUSH_SET;
+        break;
+      }
+    }
+  }
+  descriptorLibrary.pushSetI = pushSetI;
+
   descriptorLibrary.layouts.clear();
   descriptorLibrary.layouts.reserve(allSrcBindings.size());
   for (size_t layoutI = 0; layoutI < allSrcBindings.size(); layoutI++) {
     vector<memory::DescriptorSetLayout> dstLayouts;
     const vector<ShaderBinding>& srcBindings = allSrcBindings.at(layoutI);
     for (size_t setI = 0; setI < srcBindings.size(); setI++) {
-      // Copy srcBindings.at(setI) to dstBindings and set all stageFlags.
+      // Copy srcBindings.at(setI) to dstBindings. Each stageFlags is already
+      // the OR of only the stages that use the binding.
       auto srcBinding = srcBindings.at(setI);
       vector<VkDescriptorSetLayoutBinding> dstBindings(srcBinding.layouts);
-      for (size_t typeI = 0; typeI < dstBindings.size(); typeI++) {
-        dstBindings.at(typeI).stageFlags =
-            static_cast<VkShaderStageFlagBits>(srcBinding.allStageBits);
-      }
 
       dstLayouts.emplace_back(dev);
       auto& dstLayout = dstLayouts.back();
+      auto bindless = descriptorLibrary.bindless;
+      if (bindless && setI == bindless->setI) {
+        // The layout must match bindless, and is not allocated from pool.
+        if (!bindless->ds) {
+          logE("finalizeDescriptorLibrary: bindless before ctorError\n");
+          return 1;
+        }
+        for (auto& b : dstBindings) {
+          if (b.descriptorCount &&
+              (b.binding > BindlessTable::bufferBinding ||
+               b.descriptorType !=
+                   ((b.binding == BindlessTable::imageBinding)
+                        ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+                        : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER))) {
+            logE("layouts[%zu] set=%zu binding=%u %s: not a BindlessTable\n",
+                 layoutI, setI, b.binding,
+                 string_VkDescriptorType(b.descriptorType));
+            return 1;
+          }
+        }
+        if (bindless->ctorLayout(dstLayout)) {
+          logE("descriptorLibrary.layouts[%zu][%zu]: bindless failed\n",
+               layoutI, setI);
+          return 1;
+        }
+        continue;
+      }
+      if (setI == pushSetI) {
+        dstLayout.flags |=
+            VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
+      }
       if (dstLayout.ctorError(dstBindings)) {
         logE("descriptorLibrary.layouts[%zu][%zu].ctorError failed\n", layoutI,
              setI);
@@ -86,6 +180,9 @@ int ShaderLibrary::finalizeDescriptorLibrary(
         logE("finalizeDescriptorLibrary: setName(%s) failed\n", name);
         return 1;
       }
+      if (setI == pushSetI) {
+        continue;  // Push descriptor sets do not need a pool.
+      }
       auto r = descriptorLibrary.pool.emplace(std::make_pair(
           dstLayout.sizes, memory::DescriptorPool(dev, dstLayout.sizes)));
       if (!r.second) {  // Enlarge maxSets if the pool feeds multiple layouts.
@@ -94,10 +191,12 @@ int ShaderLibrary::finalizeDescriptorLibrary(
     }
     descriptorLibrary.layouts.emplace_back(std::move(dstLayouts));
   }
+  descriptorLibrary.ownerThread = this_thread::get_id();
 
   // For each pool call DescriptorPool::ctorError()
   for (auto i = descriptorLibrary.pool.begin();
        i != descriptorLibrary.pool.end(); i++) {
+    i->second.hints = descriptorLibrary.hints;
     if (i->second.ctorError()) {
       logE("finalizeDescriptorLibrary: DescriptorPool::ctorError failed\n");
       return 1;
@@ -116,7 +215,7 @@ int ShaderLibrary::finalizeDescriptorLibrary(
 
 unique_ptr<memory::DescriptorSet> DescriptorLibrary::makeSet(size_t setI,
                                                              size_t layoutI) {
-  if (pool.empty()) {
+  if (!isFinalized()) {
     logE("BUG: %smakeSet(%zu, %zu) before %sfinalizeDescriptorLibrary\n",
          "DescriptorLibrary::", setI, layoutI, "ShaderLibrary::");
     return unique_ptr<memory::DescriptorSet>();
@@ -133,30 +232,124 @@ unique_ptr<memory::DescriptorSet> DescriptorLibrary::makeSet(size_t setI,
     return unique_ptr<memory::DescriptorSet>();
   }
   auto& layout = layouts.at(layoutI).at(setI);
+  if (bindless && setI == bindless->setI) {
+    logE("BUG: %smakeSet(%zu, %zu): set is bindless. Use bindless->ds\n",
+         "DescriptorLibrary::", setI, layoutI);
+    return unique_ptr<memory::DescriptorSet>();
+  }
+  if (setI == pushSetI) {
+    // TODO: when c++14 is used, use make_unique() here.
+    return unique_ptr<memory::DescriptorSet>(
+        new memory::DescriptorSet(dev, pushParent, layout, VK_NULL_HANDLE));
+  }
 
-  auto matchingPool = pool.find(layout.sizes);
-  if (matchingPool == pool.end()) {
+  memory::DescriptorPool* matchingPool = getPool(layout.sizes);
+  if (!matchingPool) {
     logE("BUG: %smakeSet(%zu, %zu): layout has no matching pool\n",
          "DescriptorLibrary::", setI, layoutI);
     return unique_ptr<memory::DescriptorSet>();
   }
 
   VkDescriptorSet ds;
-  if (matchingPool->second.alloc(ds, layout)) {
+  if (matchingPool->alloc(ds, layout)) {
     logE("%smakeSet(%zu, %zu): pool.alloc failed\n",
          "DescriptorLibrary::", setI, layoutI);
     return unique_ptr<memory::DescriptorSet>();
   }
   // TODO: when c++14 is used, use make_unique() here.
   return unique_ptr<memory::DescriptorSet>(
-      new memory::DescriptorSet(dev, matchingPool->second, layout, ds));
+      new memory::DescriptorSet(dev, *matchingPool, layout, ds));
+}
+
+memory::DescriptorPool* DescriptorLibrary::getPool(
+    const memory::DescriptorPoolSizes& sizes) {
+  // pool is not modified after finalizeDescriptorLibrary, so find() is safe.
+  auto tmpl = pool.find(sizes);
+  if (tmpl == pool.end()) {
+    return nullptr;
+  }
+  if (this_thread::get_id() == ownerThread) {
+    return &tmpl->second;
+  }
+
+  auto& weak = threadPools[id];
+  shared_ptr<ThreadPools> mine = weak.lock();
+  if (!mine) {
+    // First makeSet() on this thread. Also drop any libraries that are gone.
+    for (auto i = threadPools.begin(); i != threadPools.end();) {
+      if (i->second.expired() && i->first != id) {
+        i = threadPools.erase(i);
+      } else {
+        i++;
+      }
+    }
+    mine = make_shared<ThreadPools>();
+    {
+      lock_guard<mutex> lock(threadsMutex);
+      threads.emplace_back(mine);
+    }
+    threadPools[id] = mine;
+  }
+
+  // Only this thread uses mine, so its pools can be renamed here.
+  string name;
+  uint64_t gen = nameGen;
+  if (gen != mine->nameGen) {
+    {
+      lock_guard<mutex> lock(threadsMutex);
+      name = debugName;
+      gen = nameGen;
+    }
+    for (auto& kv : mine->pools) {
+      if (kv.second.setName(name)) {
+        logE("%sgetPool: thread pool.setName failed\n", "DescriptorLibrary::");
+        return nullptr;
+      }
+    }
+    mine->nameGen = gen;
+  }
+
+  auto& pools = mine->pools;
+  auto r = pools.find(sizes);
+  if (r != pools.end()) {
+    return &r->second;
+  }
+  r = pools.emplace(make_pair(sizes, memory::DescriptorPool(dev, sizes))).first;
+  r->second.hints = hints;
+  if (r->second.ctorError()) {
+    logE("%sgetPool: DescriptorPool::ctorError failed\n",
+         "DescriptorLibrary::");
+    pools.erase(r);
+    return nullptr;
+  }
+  if (mine->nameGen) {
+    if (name.empty()) {
+      lock_guard<mutex> lock(threadsMutex);
+      name = debugName;
+    }
+    if (r->second.setName(name)) {
+      logE("%sgetPool: setName failed\n", "DescriptorLibrary::");
+      pools.erase(r);
+      return nullptr;
+    }
+  }
+  return &r->second;
 }
 
 int DescriptorLibrary::setName(const std::string& name) {
-  if (pool.empty()) {
+  if (!isFinalized()) {
     logE("%ssetName: nothing here, call me later.\n", "DescriptorLibrary::");
     return 1;
   }
+  if (this_thread::get_id() != ownerThread) {
+    logE("%ssetName: must be called on ownerThread\n", "DescriptorLibrary::");
+    return 1;
+  }
+  {
+    lock_guard<mutex> lock(threadsMutex);
+    debugName = name;
+    nameGen++;
+  }
   for (auto i = pool.begin(); i != pool.end(); i++) {
     if (i->second.setName(name)) {
       logE("%ssetName: pool.setName failed\n", "DescriptorLibrary::");
@@ -166,15 +359,4 @@ int DescriptorLibrary::setName(const std::string& name) {
   return 0;
 }
 
-static const std::string DescriptorLibraryGetNameEmptyError =
-    "DescriptorLibrary::getName: nothing here, call me later.";
-
-const std::string& DescriptorLibrary::getName() const {
-  if (pool.empty()) {
-    logE("%s\n", DescriptorLibraryGetNameEmptyError.c_str());
-    return DescriptorLibraryGetNameEmptyError;
-  }
-  return pool.begin()->second.getName();
-}
-
 }  // namespace science
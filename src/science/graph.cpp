@@ -0,0 +1,724 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ *
+ * Implements RenderGraph, which sorts passes and adds the barriers and
+ * semaphores between them.
+ */
+#include <algorithm>
+#include <map>
+
+#include "science.h"
+
+namespace science {
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+const size_t noPass = (size_t)-1;
+
+// isSameImage returns true if an Image created with a can be used for b.
+bool isSameImage(const VkImageCreateInfo& a, const VkImageCreateInfo& b) {
+  return a.flags == b.flags && a.imageType == b.imageType &&
+         a.format == b.format && a.extent.width == b.extent.width &&
+         a.extent.height == b.extent.height &&
+         a.extent.depth == b.extent.depth && a.mipLevels == b.mipLevels &&
+         a.arrayLayers == b.arrayLayers && a.samples == b.samples &&
+         a.tiling == b.tiling && a.usage == b.usage &&
+         a.sharingMode == b.sharingMode;
+}
+
+}  // anonymous namespace
+
+RenderGraph::~RenderGraph() {
+  if (wait()) {
+    logE("~RenderGraph: wait failed\n");
+  }
+  freeRuns();
+}
+
+size_t RenderGraph::addQueue(command::CommandPool& cpool,
+                             size_t poolQindex /*= 0*/) {
+  queues.emplace_back();
+  queues.back().cpool = &cpool;
+  queues.back().poolQindex = poolQindex;
+  isCompiled = false;
+  return queues.size() - 1;
+}
+
+size_t RenderGraph::importImage(const std::string& name, memory::Image& img) {
+  resources.emplace_back();
+  resources.back().name = name;
+  resources.back().img = &img;
+  isCompiled = false;
+  return resources.size() - 1;
+}
+
+size_t RenderGraph::importBuffer(const std::string& name,
+                                 memory::Buffer& buf) {
+  resources.emplace_back();
+  resources.back().name = name;
+  resources.back().buf = &buf;
+  isCompiled = false;
+  return resources.size() - 1;
+}
+
+size_t RenderGraph::createImage(const std::string& name,
+                                const VkImageCreateInfo& info) {
+  resources.emplace_back();
+  resources.back().name = name;
+  resources.back().info = info;
+  resources.back().isTransient = true;
+  isCompiled = false;
+  return resources.size() - 1;
+}
+
+memory::Image* RenderGraph::getImage(size_t res) {
+  if (res >= resources.size()) {
+    logE("RenderGraph::getImage(%zu): only %zu resources\n", res,
+         resources.size());
+    return nullptr;
+  }
+  return resources.at(res).img;
+}
+
+int RenderGraph::markOutput(size_t res) {
+  if (res >= resources.size()) {
+    logE("RenderGraph::markOutput(%zu): only %zu resources\n", res,
+         resources.size());
+    return 1;
+  }
+  resources.at(res).isOutput = true;
+  isCompiled = false;
+  return 0;
+}
+
+size_t RenderGraph::addPass(const std::string& name, size_t queue,
+                            RecordFn record) {
+  passes.emplace_back();
+  passes.back().name = name;
+  passes.back().queue = queue;
+  passes.back().record = record;
+  isCompiled = false;
+  return passes.size() - 1;
+}
+
+int RenderGraph::addUse(size_t pass, const Access& a) {
+  if (pass >= passes.size()) {
+    logE("RenderGraph: pass %zu: only %zu passes\n", pass, passes.size());
+    return 1;
+  }
+  auto& p = passes.at(pass);
+  if (a.res >= resources.size()) {
+    logE("RenderGraph: pass %s: resource %zu: only %zu resources\n",
+         p.name.c_str(), a.res, resources.size());
+    return 1;
+  }
+  isCompiled = false;
+  for (auto& u : p.uses) {
+    if (u.res != a.res) {
+      continue;
+    }
+    // The pass uses a.res more than once. Merge them into one Access.
+    if (a.layout != VK_IMAGE_LAYOUT_UNDEFINED &&
+        u.layout != VK_IMAGE_LAYOUT_UNDEFINED && a.layout != u.layout) {
+      logE("RenderGraph: pass %s uses %s in two different layouts\n",
+           p.name.c_str(), resources.at(a.res).name.c_str());
+      return 1;
+    }
+    if (u.layout == VK_IMAGE_LAYOUT_UNDEFINED) {
+      u.layout = a.layout;
+    }
+    if (a.finalLayout != VK_IMAGE_LAYOUT_UNDEFINED) {
+      u.finalLayout = a.finalLayout;
+    }
+    u.stage |= a.stage;
+    u.access |= a.access;
+    u.isRead |= a.isRead;
+    u.isWrite |= a.isWrite;
+    return 0;
+  }
+  p.uses.emplace_back(a);
+  return 0;
+}
+
+int RenderGraph::read(size_t pass, size_t res, VkPipelineStageFlags stage,
+                      VkAccessFlags access,
+                      VkImageLayout layout /*= VK_IMAGE_LAYOUT_UNDEFINED*/) {
+  Access a;
+  a.res = res;
+  a.stage = stage;
+  a.access = access;
+  a.layout = layout;
+  a.finalLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  a.isRead = true;
+  a.isWrite = false;
+  return addUse(pass, a);
+}
+
+int RenderGraph::write(
+    size_t pass, size_t res, VkPipelineStageFlags stage, VkAccessFlags access,
+    VkImageLayout layout /*= VK_IMAGE_LAYOUT_UNDEFINED*/,
+    VkImageLayout finalLayout /*= VK_IMAGE_LAYOUT_UNDEFINED*/) {
+  Access a;
+  a.res = res;
+  a.stage = stage;
+  a.access = access;
+  a.layout = layout;
+  a.finalLayout = finalLayout;
+  a.isRead = false;
+  a.isWrite = true;
+  return addUse(pass, a);
+}
+
+int RenderGraph::sortPasses() {
+  size_t n = passes.size();
+  for (size_t p = 0; p < n; p++) {
+    if (passes.at(p).queue >= queues.size()) {
+      logE("RenderGraph: pass %s: queue %zu: only %zu queues\n",
+           passes.at(p).name.c_str(), passes.at(p).queue, queues.size());
+      return 1;
+    }
+  }
+
+  // Passes were declared in a valid order. Walk them in that order to find
+  // the dependencies: read after write, write after write and write after
+  // read. Only a read after write keeps the earlier pass from being culled.
+  deps.clear();
+  deps.resize(n);
+  std::vector<std::vector<size_t>> readDeps(n);
+  std::vector<size_t> lastWriter(resources.size(), noPass);
+  std::vector<std::vector<size_t>> readers(resources.size());
+  for (size_t p = 0; p < n; p++) {
+    for (auto& u : passes.at(p).uses) {
+      size_t w = lastWriter.at(u.res);
+      if (u.isRead) {
+        if (w != noPass) {
+          deps.at(p).emplace_back(w);
+          readDeps.at(p).emplace_back(w);
+        } else if (resources.at(u.res).isTransient) {
+          logE("RenderGraph: pass %s reads %s before any pass writes it\n",
+               passes.at(p).name.c_str(), resources.at(u.res).name.c_str());
+          return 1;
+        }
+      }
+      if (!u.isWrite) {
+        readers.at(u.res).emplace_back(p);
+        continue;
+      }
+      if (w != noPass) {
+        deps.at(p).emplace_back(w);
+      }
+      for (auto r : readers.at(u.res)) {
+        if (r != p) {
+          deps.at(p).emplace_back(r);
+        }
+      }
+      readers.at(u.res).clear();
+      lastWriter.at(u.res) = p;
+    }
+  }
+
+  // Cull passes that do not lead to an output.
+  std::vector<bool> alive(n, false);
+  std::vector<size_t> todo;
+  for (size_t p = 0; p < n; p++) {
+    auto& pass = passes.at(p);
+    bool keep = pass.sideEffect;
+    for (auto& u : pass.uses) {
+      keep |= u.isWrite && resources.at(u.res).isOutput;
+    }
+    if (keep) {
+      alive.at(p) = true;
+      todo.emplace_back(p);
+    }
+  }
+  while (!todo.empty()) {
+    size_t p = todo.back();
+    todo.pop_back();
+    for (auto d : readDeps.at(p)) {
+      if (!alive.at(d)) {
+        alive.at(d) = true;
+        todo.emplace_back(d);
+      }
+    }
+  }
+  culledCount = std::count(alive.begin(), alive.end(), false);
+
+  // Topological sort of the passes that are left. When there is a choice,
+  // stay on the same queue to keep the number of submits down.
+  std::vector<size_t> waitCount(n, 0);
+  std::vector<std::vector<size_t>> users(n);
+  for (size_t p = 0; p < n; p++) {
+    if (!alive.at(p)) {
+      continue;
+    }
+    // Drop duplicates and culled passes.
+    auto& d = deps.at(p);
+    std::sort(d.begin(), d.end());
+    d.erase(std::unique(d.begin(), d.end()), d.end());
+    d.erase(std::remove_if(d.begin(), d.end(),
+                           [&alive](size_t a) { return !alive.at(a); }),
+            d.end());
+    for (auto a : d) {
+      waitCount.at(p)++;
+      users.at(a).emplace_back(p);
+    }
+  }
+  std::set<size_t> ready;
+  for (size_t p = 0; p < n; p++) {
+    if (alive.at(p) && !waitCount.at(p)) {
+      ready.insert(p);
+    }
+  }
+  order.clear();
+  size_t lastQueue = noPass;
+  while (!ready.empty()) {
+    auto it = ready.begin();
+    for (auto j = ready.begin(); j != ready.end(); j++) {
+      if (passes.at(*j).queue == lastQueue) {
+        it = j;
+        break;
+      }
+    }
+    size_t p = *it;
+    ready.erase(it);
+    order.emplace_back(p);
+    lastQueue = passes.at(p).queue;
+    for (auto u : users.at(p)) {
+      if (!--waitCount.at(u)) {
+        ready.insert(u);
+      }
+    }
+  }
+  return 0;
+}
+
+int RenderGraph::allocTransients() {
+  // Find the lifetime of each resource as positions in order, and the queue
+  // that uses it (noPass if more than one queue uses it).
+  firstPass.clear();
+  firstPass.resize(resources.size(), noPass);
+  std::vector<size_t> first(resources.size(), noPass);
+  std::vector<size_t> last(resources.size(), 0);
+  std::vector<size_t> queueOf(resources.size(), noPass);
+  for (size_t i = 0; i < order.size(); i++) {
+    size_t q = passes.at(order.at(i)).queue;
+    for (auto& u : passes.at(order.at(i)).uses) {
+      if (first.at(u.res) == noPass) {
+        first.at(u.res) = i;
+        firstPass.at(u.res) = order.at(i);
+        queueOf.at(u.res) = q;
+      } else if (queueOf.at(u.res) != q) {
+        queueOf.at(u.res) = noPass;
+      }
+      last.at(u.res) = i;
+    }
+  }
+
+  importedSlots = 0;
+  std::vector<size_t> transients;
+  for (size_t r = 0; r < resources.size(); r++) {
+    auto& res = resources.at(r);
+    if (!res.isTransient) {
+      res.slot = importedSlots++;
+      continue;
+    }
+    res.img = nullptr;
+    if (first.at(r) != noPass) {
+      transients.emplace_back(r);
+    }
+  }
+  std::sort(transients.begin(), transients.end(),
+            [&first](size_t a, size_t b) { return first.at(a) < first.at(b); });
+
+  // Reuse an Image once the last pass that used it is done. Only images used
+  // on a single queue are reused, since passes on different queues may
+  // overlap. Images from the previous compile() are reused if they match.
+  std::vector<std::shared_ptr<memory::Image>> old;
+  old.swap(transientImages);
+  std::vector<size_t> busyUntil;
+  std::vector<size_t> busyQueue;
+  for (auto r : transients) {
+    auto& res = resources.at(r);
+    size_t found = noPass;
+    for (size_t i = 0; i < transientImages.size(); i++) {
+      if (queueOf.at(r) != noPass && busyQueue.at(i) == queueOf.at(r) &&
+          busyUntil.at(i) < first.at(r) &&
+          isSameImage(transientImages.at(i)->info, res.info)) {
+        found = i;
+        break;
+      }
+    }
+    if (found == noPass) {
+      std::shared_ptr<memory::Image> img;
+      for (auto it = old.begin(); it != old.end(); it++) {
+        if (isSameImage((*it)->info, res.info)) {
+          img = *it;
+          old.erase(it);
+          break;
+        }
+      }
+      if (!img) {
+        img = std::make_shared<memory::Image>(dev);
+        img->info = res.info;
+        if (img->ctorAndBindDeviceLocal()) {
+          logE("RenderGraph: createImage(%s) failed\n", res.name.c_str());
+          return 1;
+        }
+        if (img->setName(res.name)) {
+          logE("RenderGraph: createImage(%s): setName failed\n",
+               res.name.c_str());
+          return 1;
+        }
+      }
+      found = transientImages.size();
+      transientImages.emplace_back(img);
+      busyUntil.emplace_back(0);
+      busyQueue.emplace_back(0);
+    }
+    busyUntil.at(found) = last.at(r);
+    busyQueue.at(found) = queueOf.at(r);
+    res.img = transientImages.at(found).get();
+    res.slot = importedSlots + found;
+  }
+
+  // The previous execute() is done, but what it did is not known any more.
+  slots.clear();
+  slots.resize(importedSlots + transientImages.size());
+  return 0;
+}
+
+int RenderGraph::buildRuns() {
+  std::vector<size_t> runOf(passes.size(), noPass);
+  for (auto p : order) {
+    if (runs.empty() || runs.back().queue != passes.at(p).queue) {
+      runs.emplace_back();
+      runs.back().queue = passes.at(p).queue;
+    }
+    runs.back().passes.emplace_back(p);
+    runOf.at(p) = runs.size() - 1;
+  }
+
+  // A dependency on a pass on another queue needs a semaphore.
+  std::vector<std::map<size_t, VkPipelineStageFlags>> waits(runs.size());
+  for (auto p : order) {
+    size_t b = runOf.at(p);
+    VkPipelineStageFlags stage = 0;
+    for (auto& u : passes.at(p).uses) {
+      stage |= u.stage;
+    }
+    for (auto d : deps.at(p)) {
+      size_t a = runOf.at(d);
+      if (a != noPass && runs.at(a).queue != runs.at(b).queue) {
+        waits.at(b)[a] |= stage;
+      }
+    }
+  }
+  for (size_t b = 0; b < runs.size(); b++) {
+    for (auto& w : waits.at(b)) {
+      auto sem = std::make_shared<command::Semaphore>(dev);
+      if (sem->ctorError()) {
+        logE("RenderGraph: run %zu: Semaphore::ctorError failed\n", w.first);
+        return 1;
+      }
+      runs.at(w.first).signal.emplace_back(sem);
+      runs.at(b).waitFor.emplace_back(*sem, w.second);
+      runs.at(b).waitRuns.emplace_back(w.first);
+    }
+  }
+
+  for (auto& run : runs) {
+    auto& cpool = *queues.at(run.queue).cpool;
+    std::vector<VkCommandBuffer> vk(1);
+    if (cpool.alloc(vk)) {
+      logE("RenderGraph: alloc failed\n");
+      return 1;
+    }
+    run.cmd = std::make_shared<command::CommandBuffer>(cpool);
+    run.cmd->vk = vk.at(0);
+  }
+  return 0;
+}
+
+void RenderGraph::freeRuns() {
+  for (auto& run : runs) {
+    if (run.cmd && run.cmd->vk) {
+      std::vector<VkCommandBuffer> vk{run.cmd->vk};
+      run.cmd->cpool.free(vk);
+      run.cmd->vk = VK_NULL_HANDLE;
+    }
+  }
+  runs.clear();
+}
+
+int RenderGraph::compile() {
+  if (wait()) {
+    logE("RenderGraph::compile: wait failed\n");
+    return 1;
+  }
+  isCompiled = false;
+  freeRuns();
+  if (sortPasses()) {
+    logE("RenderGraph::compile: sortPasses failed\n");
+    return 1;
+  }
+  if (allocTransients()) {
+    logE("RenderGraph::compile: allocTransients failed\n");
+    return 1;
+  }
+  if (buildRuns()) {
+    logE("RenderGraph::compile: buildRuns failed\n");
+    return 1;
+  }
+  isCompiled = true;
+  return 0;
+}
+
+int RenderGraph::addBarriers(size_t pass, command::CommandBuffer& cmd) {
+  auto& p = passes.at(pass);
+  command::CommandBuffer::BarrierSet b;
+  b.srcStageMask = 0;
+  b.dstStageMask = 0;
+  VkMemoryBarrier mb;
+  memset(&mb, 0, sizeof(mb));
+  mb.sType = autoSType(mb);
+  bool needMem = false;
+
+  for (auto& u : p.uses) {
+    auto& res = resources.at(u.res);
+    auto& st = slots.at(res.slot);
+    if (res.isTransient && firstPass.at(u.res) == pass) {
+      // The contents from before this execute() are discarded.
+      res.img->currentLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      res.img->subLayout.clear();
+    }
+
+    VkPipelineStageFlags src = 0;
+    VkAccessFlags srcAccess = 0;
+    bool need = false;
+    if (!st.isValid) {
+      if (!res.isTransient) {
+        // Anything could have happened to an imported resource.
+        need = true;
+        src = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+        srcAccess = VK_ACCESS_MEMORY_WRITE_BIT;
+      }
+    } else if (st.queue != p.queue) {
+      // A semaphore already made the previous use available. A layout change
+      // only has to wait for the stage the semaphore waits at.
+      st = SyncState();
+      src = u.stage;
+    } else if (u.isWrite) {
+      src = st.writeStage | st.readStages;
+      srcAccess = st.writeAccess;
+      need = src != 0;
+    } else if (st.writeStage && ((st.visibleStages & u.stage) != u.stage ||
+                                 (st.visibleAccess & u.access) != u.access)) {
+      src = st.writeStage;
+      srcAccess = st.writeAccess;
+      need = true;
+    }
+
+    size_t before = b.img.size();
+    if (res.img && u.layout != VK_IMAGE_LAYOUT_UNDEFINED) {
+      auto range = res.img->getSubresourceRange();
+      if (res.img->makeTransitions(u.layout, range, b.img)) {
+        logE("RenderGraph: pass %s: %s: makeTransitions failed\n",
+             p.name.c_str(), res.name.c_str());
+        return 1;
+      }
+      res.img->setLayout(range, u.layout);
+    }
+    bool layoutChange = b.img.size() != before;
+    if (layoutChange) {
+      for (size_t i = before; i < b.img.size(); i++) {
+        b.img.at(i).srcAccessMask = srcAccess;
+        b.img.at(i).dstAccessMask = u.access;
+      }
+    } else if (need) {
+      mb.srcAccessMask |= srcAccess;
+      mb.dstAccessMask |= u.access;
+      needMem = true;
+    }
+    if (need || layoutChange) {
+      b.srcStageMask |= src ? src : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+      b.dstStageMask |= u.stage;
+    }
+
+    st.isValid = true;
+    st.queue = p.queue;
+    if (u.isWrite) {
+      st.writeStage = u.stage;
+      st.writeAccess = u.access;
+      st.readStages = 0;
+      st.visibleStages = 0;
+      st.visibleAccess = 0;
+    } else if (layoutChange) {
+      // The layout change is a write which the barrier made visible to u.
+      st.writeStage = u.stage;
+      st.writeAccess = 0;
+      st.readStages = u.stage;
+      st.visibleStages = u.stage;
+      st.visibleAccess = u.access;
+    } else {
+      st.readStages |= u.stage;
+      if (need) {
+        st.visibleStages |= u.stage;
+        st.visibleAccess |= u.access;
+      }
+    }
+  }
+
+  if (needMem) {
+    b.mem.emplace_back(mb);
+  }
+  if (b.mem.empty() && b.img.empty()) {
+    return 0;
+  }
+  barrierCount += b.mem.size() + b.img.size();
+  if (cmd.waitBarrier(b)) {
+    logE("RenderGraph: pass %s: waitBarrier failed\n", p.name.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int RenderGraph::execute() {
+  if (!isCompiled && compile()) {
+    logE("RenderGraph::execute: compile failed\n");
+    return 1;
+  }
+  if (wait()) {
+    logE("RenderGraph::execute: wait failed\n");
+    return 1;
+  }
+  for (size_t i = importedSlots; i < slots.size(); i++) {
+    slots.at(i) = SyncState();
+  }
+
+  barrierCount = 0;
+  for (auto& run : runs) {
+    auto& cmd = *run.cmd;
+    if (cmd.beginOneTimeUse()) {
+      logE("RenderGraph::execute: beginOneTimeUse failed\n");
+      return 1;
+    }
+    for (auto i : run.passes) {
+      auto& p = passes.at(i);
+      if (addBarriers(i, cmd)) {
+        logE("RenderGraph::execute: addBarriers(%s) failed\n", p.name.c_str());
+        return 1;
+      }
+      if (p.record && p.record(cmd)) {
+        logE("RenderGraph::execute: pass %s failed\n", p.name.c_str());
+        return 1;
+      }
+      for (auto& u : p.uses) {
+        auto img = resources.at(u.res).img;
+        if (img && u.finalLayout != VK_IMAGE_LAYOUT_UNDEFINED) {
+          img->currentLayout = u.finalLayout;
+          img->subLayout.clear();
+        }
+      }
+    }
+    if (cmd.end()) {
+      logE("RenderGraph::execute: end failed\n");
+      return 1;
+    }
+  }
+  return submit();
+}
+
+int RenderGraph::submit() {
+  std::vector<std::vector<command::SubmitInfo>> pending(queues.size());
+  std::vector<std::vector<size_t>> pendingRuns(queues.size());
+  std::vector<bool> used(queues.size(), false);
+  submitCount = 0;
+
+  auto flush = [&](size_t q, VkFence fence) -> int {
+    auto& queue = queues.at(q);
+    command::CommandPool::lock_guard_t lock(queue.cpool->lockmutex);
+    if (queue.cpool->submit(lock, queue.poolQindex, pending.at(q), fence)) {
+      logE("RenderGraph::submit: queue %zu submit failed\n", q);
+      return 1;
+    }
+    submitCount++;
+    pending.at(q).clear();
+    pendingRuns.at(q).clear();
+    return 0;
+  };
+
+  for (size_t i = 0; i < runs.size(); i++) {
+    auto& run = runs.at(i);
+    // A semaphore can only be waited on after the batch that signals it has
+    // been submitted.
+    for (auto a : run.waitRuns) {
+      auto& pr = pendingRuns.at(runs.at(a).queue);
+      if (std::find(pr.begin(), pr.end(), a) != pr.end() &&
+          flush(runs.at(a).queue, VK_NULL_HANDLE)) {
+        return 1;
+      }
+    }
+    command::SubmitInfo info;
+    info.waitFor = run.waitFor;
+    for (auto p : run.passes) {
+      auto& pass = passes.at(p);
+      info.waitFor.insert(info.waitFor.end(), pass.waitFor.begin(),
+                          pass.waitFor.end());
+      info.toSignal.insert(info.toSignal.end(), pass.toSignal.begin(),
+                           pass.toSignal.end());
+    }
+    for (auto& sem : run.signal) {
+      info.toSignal.emplace_back(sem->vk);
+    }
+    {
+      command::CommandPool::lock_guard_t lock(run.cmd->cpool.lockmutex);
+      if (run.cmd->enqueue(lock, info)) {
+        logE("RenderGraph::submit: enqueue failed\n");
+        return 1;
+      }
+    }
+    pending.at(run.queue).emplace_back(info);
+    pendingRuns.at(run.queue).emplace_back(i);
+    used.at(run.queue) = true;
+  }
+
+  for (size_t q = 0; q < queues.size(); q++) {
+    if (!used.at(q)) {
+      continue;
+    }
+    auto& queue = queues.at(q);
+    queue.fence = queue.cpool->borrowFence();
+    if (!queue.fence) {
+      logE("RenderGraph::submit: borrowFence failed\n");
+      return 1;
+    }
+    if (flush(q, queue.fence->vk)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int RenderGraph::wait() {
+  int r = 0;
+  for (auto& queue : queues) {
+    if (!queue.fence) {
+      continue;
+    }
+    // A heavy frame can take longer than the timeout, so keep waiting.
+    VkResult v;
+    do {
+      v = queue.fence->waitMs(1000);
+    } while (v == VK_TIMEOUT);
+    if (v != VK_SUCCESS) {
+      r |= explainVkResult("RenderGraph::wait: fence.waitMs", v);
+    }
+    if (queue.cpool->unborrowFence(queue.fence)) {
+      logE("RenderGraph::wait: unborrowFence failed\n");
+      r = 1;
+    }
+    queue.fence.reset();
+  }
+  return r;
+}
+
+}  // namespace science
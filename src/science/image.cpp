@@ -61,7 +61,8 @@ int copyImageMipLevel(command::CommandBuffer& buffer, memory::Image& src,
     return 1;
   }
 
-  // This does NOT verify the mip level of src and dst are in the right layout.
+  // This does NOT transition the mip level of src and dst. It uses the layout
+  // of array layer 0 of the mip level for all array layers.
   VkImageCopy region;
   region.srcSubresource = src.getSubresourceLayers(srcMipLevel);
   region.dstSubresource = dst.getSubresourceLayers(dstMipLevel);
@@ -74,7 +75,8 @@ int copyImageMipLevel(command::CommandBuffer& buffer, memory::Image& src,
   region.extent = se;
   region.extent.width = std::max(1u, se.width >> srcMipLevel);
   region.extent.height = std::max(1u, se.height >> srcMipLevel);
-  return buffer.copyImage(src, dst, {region});
+  return buffer.copyImage(src.vk, src.getLayout(srcMipLevel), dst.vk,
+                          dst.getLayout(dstMipLevel), {region});
 }
 
 int copyImageToMipmap(command::CommandBuffer& buffer, memory::Image& img) {
@@ -132,18 +134,13 @@ int copyImageToMipmap(command::CommandBuffer& buffer, memory::Image& img) {
   }
 
   // Transition last mip level so whole img is in one consistent layout.
+  // img tracks the layout of each mip level, so after this barrier
+  // img.currentLayout is TRANSFER_SRC_OPTIMAL again.
   sub.baseMipLevel = img.info.mipLevels - 1;
   if (buffer.barrier(img, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, sub)) {
     logE("barrier(TRANSFER_SRC, %u) failed\n", img.info.mipLevels - 1);
     return 1;
   }
-
-  // Unlike buffer.barrier(img, DST_OPT), the buffer.barrier() calls above were
-  // buffer.barrier(img, SRC_OPT, range) and do NOT update img.currentLayout.
-  // That's because different mip levels had different layouts - there wasn't
-  // a single consistent layout. At this point all the levels have changed,
-  // but currentLayout has to be set manually.
-  img.currentLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
   return 0;
 }
 
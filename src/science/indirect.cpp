@@ -0,0 +1,117 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ *
+ * Implements IndirectDrawBatcher, which packs many InstanceBuf into one
+ * indirect draw buffer.
+ */
+#include <algorithm>
+
+#include "science.h"
+
+namespace science {
+
+void IndirectDrawBatcher::add(std::shared_ptr<command::Pipeline> pipe,
+                              const InstanceBuf& ib) {
+  auto key = std::make_tuple(pipe.get(), ib.vk, ib.ofs);
+  auto it = groupIndex.find(key);
+  if (it == groupIndex.end()) {
+    it = groupIndex.emplace(key, groups.size()).first;
+    groups.emplace_back();
+    auto& g = groups.back();
+    g.pipe = pipe;
+    g.instanceBuf = ib.vk;
+    g.ofs = ib.ofs;
+  }
+  groups.at(it->second).cmds.emplace_back(ib.cmd);
+  total++;
+  uploaded = false;
+}
+
+int IndirectDrawBatcher::upload() {
+  uploaded = false;
+  if (!total) {
+    uploaded = true;
+    return 0;
+  }
+
+  // Lay out all commands, then one uint32_t count per group.
+  constexpr size_t stride = sizeof(VkDrawIndexedIndirectCommand);
+  size_t size = total * stride + groups.size() * sizeof(uint32_t);
+  if (!mapped || buf.info.size < size) {
+    // Grow by at least 2x to avoid reallocating every frame.
+    if (mapped) {
+      buf.mem.munmap();
+      mapped = nullptr;
+    }
+    buf.info.size = std::max((VkDeviceSize)size, buf.info.size * 2);
+    buf.info.usage |= VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+#ifndef VOLCANO_DISABLE_VULKANMEMORYALLOCATOR
+    buf.vmaUsage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+#endif /* VOLCANO_DISABLE_VULKANMEMORYALLOCATOR */
+    if (buf.ctorAndBindHostCoherent() || buf.mem.mmap(&mapped)) {
+      logE("IndirectDrawBatcher::upload: buf.ctorError or mmap failed\n");
+      mapped = nullptr;
+      return 1;
+    }
+  }
+
+  // buf is host coherent, so the writes are visible to the device when the
+  // command buffer that draws from it is submitted. There is no copy to wait
+  // for.
+  char* out = reinterpret_cast<char*>(mapped);
+  auto counts = reinterpret_cast<uint32_t*>(out + total * stride);
+  size_t first = 0;
+  for (size_t i = 0; i < groups.size(); i++) {
+    auto& g = groups.at(i);
+    g.first = first;
+    memcpy(out + first * stride, g.cmds.data(), g.cmds.size() * stride);
+    counts[i] = (uint32_t)g.cmds.size();
+    first += g.cmds.size();
+  }
+  uploaded = true;
+  return 0;
+}
+
+int IndirectDrawBatcher::draw(command::CommandBuffer& cmd, BindFn fn) {
+  drawCalls = 0;
+  if (!uploaded) {
+    logE("IndirectDrawBatcher::draw: call upload first\n");
+    return 1;
+  }
+  auto& dev = cmd.cpool.vk.dev;
+  uint32_t maxDraw = 1;
+  if (dev.enabledFeatures.features.multiDrawIndirect) {
+    maxDraw = dev.physProp.properties.limits.maxDrawIndirectCount;
+  }
+  constexpr uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+  VkDeviceSize countOfs = total * stride;
+  for (size_t i = 0; i < groups.size(); i++) {
+    auto& g = groups.at(i);
+    if (fn(cmd, *g.pipe, g.instanceBuf, g.ofs)) {
+      logE("IndirectDrawBatcher::draw: groups[%zu] BindFn failed\n", i);
+      return 1;
+    }
+    size_t n = g.cmds.size();
+    if (maxDraw > 1 && n <= maxDraw && cmd.cpool.fp.drawIndexedIndirectCount) {
+      if (cmd.drawIndexedIndirectCount(buf.vk, g.first * stride, buf.vk,
+                                       countOfs + i * sizeof(uint32_t),
+                                       (uint32_t)n, stride)) {
+        logE("IndirectDrawBatcher::draw: drawIndexedIndirectCount failed\n");
+        return 1;
+      }
+      drawCalls++;
+      continue;
+    }
+    for (size_t j = 0; j < n; j += maxDraw) {
+      uint32_t count = (uint32_t)std::min(n - j, (size_t)maxDraw);
+      if (cmd.drawIndexedIndirect(buf.vk, (g.first + j) * stride, count,
+                                  stride)) {
+        logE("IndirectDrawBatcher::draw: drawIndexedIndirect failed\n");
+        return 1;
+      }
+      drawCalls++;
+    }
+  }
+  return 0;
+}
+
+}  // namespace science
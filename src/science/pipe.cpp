@@ -6,10 +6,16 @@
 namespace science {
 
 int PipeBuilder::deriveFrom(PipeBuilder& other) {
+  if (!other.pipe) {
+    logE("PipeBuilder::deriveFrom: other.pipe is NULL\n");
+    return 1;
+  }
+  other.info().flags |= VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT;
   pipe = std::make_shared<command::Pipeline>(pass);
   pipe->info = other.info();
   pipe->commandBufferType = other.pipe->commandBufferType;
   pipe->clearColors = other.pipe->clearColors;
+  pipe->basePipe = other.pipe;
   return 0;
 }
 
@@ -41,6 +47,28 @@ int PipeBuilder::swap(PipeBuilder& other) {
   return 1;
 }
 
+int PipeBuilder::ctorErrorAsync(PipeBuilder& other,
+                                std::shared_ptr<command::AsyncPipeline>& out) {
+  if (!pipe) {
+    logE("PipeBuilder::ctorErrorAsync: this pipe is NULL\n");
+    return 1;
+  }
+  if (&pass != &other.pass) {
+    logE("PipeBuilder::ctorErrorAsync: this.pass=%p other.pass=%p differ.\n",
+         &pass, &other.pass);
+    return 1;
+  }
+  for (size_t i = 0; i < pass.pipelines.size(); i++) {
+    if (pass.pipelines.at(i) == other.pipe) {
+      out = std::make_shared<command::AsyncPipeline>(pipe, other.pipe);
+      return out->ctorError(pass, i);
+    }
+  }
+  logE("PipeBuilder::ctorErrorAsync: pipe %p not found in pass %p\n",
+       &*other.pipe, pass.vk ? pass.vk.printf() : NULL);
+  return 1;
+}
+
 int PipeBuilder::alphaBlendWith(const command::PipelineCreateInfo& prevPipeInfo,
                                 VkObjectType boundary) {
   auto& pipeInfo = info();
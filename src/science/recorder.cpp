@@ -0,0 +1,213 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ *
+ * Implements ParallelRecorder, which records secondary command buffers on
+ * several threads, and CachedCommandBuffer.
+ */
+#include <algorithm>
+
+#include "science.h"
+
+namespace science {
+
+ParallelRecorder::~ParallelRecorder() { stop(); }
+
+void ParallelRecorder::stop() {
+  {
+    std::lock_guard<std::mutex> lock(lockmutex);
+    quit = true;
+  }
+  wake.notify_all();
+  for (auto& w : workers) {
+    if (w->thread.joinable()) {
+      w->thread.join();
+    }
+  }
+  std::lock_guard<std::mutex> lock(lockmutex);
+  quit = false;
+  // Workers started later begin with seen = 0, so generation must match.
+  generation = 0;
+}
+
+int ParallelRecorder::ctorError(size_t numSlots,
+                                size_t numWorkers /*= 0*/,
+                                language::SurfaceSupport queueFamily
+                                /*= language::GRAPHICS*/) {
+  if (!numSlots) {
+    logE("ParallelRecorder::ctorError: numSlots must not be 0\n");
+    return 1;
+  }
+  if (!numWorkers) {
+    numWorkers = std::max(1u, std::thread::hardware_concurrency());
+  }
+  stop();
+  workers.clear();
+  // Build the workers in a local vector. If anything fails, workers stays
+  // empty, so record() refuses to run instead of waiting on threads that
+  // were never started.
+  std::vector<std::shared_ptr<Worker>> created;
+  for (size_t i = 0; i < numWorkers; i++) {
+    created.emplace_back(std::make_shared<Worker>(dev));
+    auto& w = *created.back();
+    w.cpool.queueFamily = queueFamily;
+    if (w.cpool.ctorError()) {
+      logE("ParallelRecorder::ctorError: worker[%zu] cpool failed\n", i);
+      return 1;
+    }
+    std::vector<VkCommandBuffer> vkBufs(numSlots);
+    if (w.cpool.alloc(vkBufs, VK_COMMAND_BUFFER_LEVEL_SECONDARY)) {
+      logE("ParallelRecorder::ctorError: worker[%zu] alloc failed\n", i);
+      return 1;
+    }
+    for (auto vk : vkBufs) {
+      w.bufs.emplace_back(w.cpool);
+      w.bufs.back().vk = vk;
+    }
+  }
+  workers.swap(created);
+
+  // Worker 0 is the calling thread.
+  for (size_t i = 1; i < workers.size(); i++) {
+    workers.at(i)->thread = std::thread(&ParallelRecorder::workerMain, this, i);
+  }
+  return 0;
+}
+
+void ParallelRecorder::workerMain(size_t i) {
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> lock(lockmutex);
+  for (;;) {
+    wake.wait(lock, [&] { return quit || generation != seen; });
+    if (quit) {
+      return;
+    }
+    seen = generation;
+    auto fn = job;
+    lock.unlock();
+    fn(i);
+    lock.lock();
+    pending--;
+    if (!pending) {
+      done.notify_all();
+    }
+  }
+}
+
+void ParallelRecorder::run(std::function<void(size_t)> fn) {
+  {
+    std::lock_guard<std::mutex> lock(lockmutex);
+    job = fn;
+    pending = workers.size() - 1;
+    generation++;
+  }
+  wake.notify_all();
+  fn(0);
+  std::unique_lock<std::mutex> lock(lockmutex);
+  done.wait(lock, [&] { return !pending; });
+  job = nullptr;
+}
+
+int ParallelRecorder::record(command::CommandBuffer& primary,
+                             command::RenderPass& pass, uint32_t subpass,
+                             language::Framebuf& framebuf, size_t slot,
+                             size_t drawCount, RecordFn fn) {
+  if (workers.empty()) {
+    logE("ParallelRecorder::record without a successful ctorError\n");
+    return 1;
+  }
+  if (slot >= workers.at(0)->bufs.size()) {
+    logE("ParallelRecorder::record: slot %zu out of range (%zu slots)\n", slot,
+         workers.at(0)->bufs.size());
+    return 1;
+  }
+  if (subpass >= pass.pipelines.size() || !pass.pipelines.at(subpass)) {
+    logE("ParallelRecorder::record: subpass %u is invalid\n", subpass);
+    return 1;
+  }
+  if (pass.pipelines.at(subpass)->commandBufferType !=
+      VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS) {
+    logE("ParallelRecorder::record: subpass %u %s\n", subpass,
+         "commandBufferType is not SECONDARY_COMMAND_BUFFERS");
+    return 1;
+  }
+
+  VkCommandBufferInheritanceInfo inherit;
+  memset(&inherit, 0, sizeof(inherit));
+  inherit.sType = autoSType(inherit);
+  inherit.renderPass = pass.vk;
+  inherit.subpass = subpass;
+  inherit.framebuffer = framebuf.vk;
+
+  // Split the draws into contiguous chunks so they stay in order.
+  size_t n = workers.size();
+  size_t chunk = (drawCount + n - 1) / n;
+  std::vector<int> result(n, 0);
+  run([&](size_t w) {
+    size_t first = std::min(drawCount, w * chunk);
+    size_t count = std::min(chunk, drawCount - first);
+    if (!count) {
+      return;
+    }
+    auto& cmd = workers.at(w)->bufs.at(slot);
+    if (cmd.begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                      VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+                  &inherit)) {
+      logE("ParallelRecorder::record: worker[%zu] begin failed\n", w);
+      result.at(w) = 1;
+      return;
+    }
+    if (fn(cmd, first, count, w)) {
+      logE("ParallelRecorder::record: worker[%zu] RecordFn failed\n", w);
+      result.at(w) = 1;
+    }
+    if (cmd.end()) {
+      logE("ParallelRecorder::record: worker[%zu] end failed\n", w);
+      result.at(w) = 1;
+    }
+  });
+
+  std::vector<VkCommandBuffer> secondary;
+  for (size_t w = 0; w < n; w++) {
+    if (result.at(w)) {
+      return 1;
+    }
+    if (w * chunk < drawCount) {
+      secondary.emplace_back(workers.at(w)->bufs.at(slot).vk);
+    }
+  }
+  if (secondary.empty()) {
+    return 0;
+  }
+  return primary.executeCommands(secondary);
+}
+
+int CachedCommandBuffer::record(const InputHash& inputs, RecordFn fn,
+                                VkCommandBufferUsageFlags usageFlags) {
+  if (usageFlags & VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT) {
+    logE("CachedCommandBuffer::record: ONE_TIME_SUBMIT cannot be replayed\n");
+    return 1;
+  }
+  if (!isDirty(inputs)) {
+    replayCount++;
+    return 0;
+  }
+  // If anything below fails, the buffer must be recorded again next time.
+  dirty = true;
+  if (begin(usageFlags)) {
+    logE("CachedCommandBuffer::record: begin failed\n");
+    return 1;
+  }
+  if (fn(*this)) {
+    logE("CachedCommandBuffer::record: RecordFn failed\n");
+    return 1;
+  }
+  if (end()) {
+    logE("CachedCommandBuffer::record: end failed\n");
+    return 1;
+  }
+  recordedHash = inputs.value;
+  dirty = false;
+  recordCount++;
+  return 0;
+}
+
+}  // namespace science
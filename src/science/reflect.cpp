@@ -7,6 +7,7 @@
 #include "reflect.h"
 
 #include <map>
+#include <set>
 #include <sstream>
 #include <vendor/spirv_cross/spirv_glsl.hpp>
 
@@ -114,8 +115,11 @@ struct ShaderLibraryInternal {
     const spirv_cross::SmallVector<spirv_cross::Resource>& resources;
   };
 
+  // reflectResource adds every resource in rtm to the layout, but only adds
+  // stageBits to the stageFlags of resources whose id is in active.
   int reflectResource(size_t layoutIndex, VkShaderStageFlagBits stageBits,
                       spirv_cross::CompilerGLSL& compiler,
+                      const std::set<uint32_t>& active,
                       ResourceTypeMap& rtm) {
     if (bindings.size() < layoutIndex + 1) {
       bindings.resize(layoutIndex + 1);
@@ -132,7 +136,6 @@ struct ShaderLibraryInternal {
       }
 
       ShaderLibrary::ShaderBinding& binding = bindSet.at(setI);
-      binding.allStageBits |= stageBits;
 
       uint32_t bindingI = 0;
       if (bitset.get(spv::DecorationBinding)) {
@@ -170,9 +173,11 @@ struct ShaderLibraryInternal {
       layoutBinding.descriptorCount = 1;
       layoutBinding.descriptorType = rtm.descriptorType;
       layoutBinding.pImmutableSamplers = nullptr;
-      // layoutBinding1.stageFlags is set in
-      // ShaderLibrary::finalizeDescriptorLibrary to the OR of all stageBits.
-      // It is being collected in binding.allStageBits above.
+      // Only the stages that actually reference this binding see it. A
+      // binding no stage uses is still in the layout, with no stageFlags.
+      if (active.count(res.id)) {
+        layoutBinding.stageFlags |= stageBits;
+      }
       if (0)
         logI("layout=%zu set=%u binding=%u type=%u\n", layoutIndex, setI,
              bindingI, rtm.descriptorType);
@@ -183,8 +188,13 @@ struct ShaderLibraryInternal {
   int reflectStage(size_t layoutIndex, VkShaderStageFlagBits stageBits,
                    spirv_cross::CompilerGLSL& compiler,
                    PipelineCreateInfo& pipeInfo) {
-    // Use reflection to read the shader layouts.
+    // Use reflection to read the shader layouts. Every declared resource is
+    // in the layout, but a stage only sees the ones its entry point uses.
     auto resources = compiler.get_shader_resources();
+    std::set<uint32_t> active;
+    for (auto id : compiler.get_active_interface_variables()) {
+      active.insert(id);
+    }
     if (0) print_stage(compiler, resources, stageBits);
 
     vector<ResourceTypeMap> resourceTypeMap{
@@ -203,7 +213,7 @@ struct ShaderLibraryInternal {
         // VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT is not applicable.
     };
     for (auto& r : resourceTypeMap) {
-      if (reflectResource(layoutIndex, stageBits, compiler, r)) {
+      if (reflectResource(layoutIndex, stageBits, compiler, active, r)) {
         logE("reflectResource(%s (%d)) failed\n",
              string_VkDescriptorType(r.descriptorType), r.descriptorType);
         return 1;
@@ -290,8 +300,13 @@ int ShaderLibrary::add(PipeBuilder& pipeBuilder, shared_ptr<Shader> shader,
   if (!_i) {
     _i = new ShaderLibraryInternal();
   }
+  if (!shader->code()) {
+    logE("ShaderLibrary::add: shader bytes are empty (released?)\n");
+    return 1;
+  }
   // Decompile the shader
-  spirv_cross::CompilerGLSL compiler(shader->bytes);
+  spirv_cross::CompilerGLSL compiler(shader->code(),
+                                     shader->codeLen() / sizeof(uint32_t));
 
   spirv_cross::SmallVector<spirv_cross::EntryPoint> eps =
       compiler.get_entry_points_and_stages();
@@ -332,8 +347,13 @@ int ShaderLibrary::add(PipeBuilder& pipeBuilder, shared_ptr<Shader> shader,
     logE("BUG: %sadd with stageBits == 0\n", "ShaderLibrary::");
     return 1;
   }
+  if (!shader->code()) {
+    logE("ShaderLibrary::add: shader bytes are empty (released?)\n");
+    return 1;
+  }
   // Decompile the shader
-  spirv_cross::CompilerGLSL compiler(shader->bytes);
+  spirv_cross::CompilerGLSL compiler(shader->code(),
+                                     shader->codeLen() / sizeof(uint32_t));
   pipeBuilder.info();
   if (_i->finalShaderAddLogic(pipeBuilder.pipe, shader, layoutIndex, stageBits,
                               compiler)) {
@@ -372,8 +392,13 @@ int ShaderLibrary::add(std::shared_ptr<command::Pipeline> compute,
   if (!_i) {
     _i = new ShaderLibraryInternal();
   }
+  if (!stage.shader->code()) {
+    logE("ShaderLibrary::add: shader bytes are empty (released?)\n");
+    return 1;
+  }
   // Decompile the shader
-  spirv_cross::CompilerGLSL compiler(stage.shader->bytes);
+  spirv_cross::CompilerGLSL compiler(
+      stage.shader->code(), stage.shader->codeLen() / sizeof(uint32_t));
   return _i->finalShaderAddLogic(compute, stage.shader, layoutIndex,
                                  stage.info.stage, compiler);
 }
@@ -10,8 +10,12 @@
  * * Sampler class builds on Image, ImageView
  * * CommandPoolContainer class is composed of CommandPool, RenderPass
  * * SmartCommandBuffer class adds convenient methods for CommandBuffers
+ * * ParallelRecorder records secondary CommandBuffers on several threads
+ * * CachedCommandBuffer only re-records commands when their inputs change
+ * * RenderGraph orders passes and adds barriers and semaphores for them
  * * PipeBuilder class builds Pipeline objects and Pipeline derivatives
  * * ShaderLibrary and DescriptorLibrary do shader reflection
+ * * BindlessTable is a descriptor indexing table of images and buffers
  */
 
 #include <src/command/command.h>
@@ -19,8 +23,13 @@
 #include <src/memory/memory.h>
 #include <string.h>
 
+#include <condition_variable>
+#include <functional>
 #include <limits>
 #include <set>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #ifndef _WIN32
 #include <unistd.h>
 #endif
@@ -39,9 +48,9 @@ int copyImage1to1(command::CommandBuffer& buffer, memory::Image& src,
                   memory::Image& dst);
 
 // copyImageMipLevel copies a single mip level from src to dst.
-// NOTE: This does NOT add a layout transition. memory::Image does not track
-//       the layout of each mip level. You must transition the mip level or
-//       the whole image first before calling copyImageMipLevel().
+// NOTE: This does NOT add a layout transition. You must transition the mip
+//       level (memory::Image tracks the layout of each mip level) or the
+//       whole image first before calling copyImageMipLevel().
 int copyImageMipLevel(command::CommandBuffer& buffer, memory::Image& src,
                       uint32_t srcMipLevel, memory::Image& dst,
                       uint32_t dstMipLevel);
@@ -106,6 +115,12 @@ typedef struct Sampler {
       imageInfo->sampler = VK_NULL_HANDLE;
       return;
     }
+    if (image->hasMixedLayouts()) {
+      logE("Sampler::toDescriptor: image has mixed layouts\n");
+      imageInfo->imageView = VK_NULL_HANDLE;
+      imageInfo->sampler = VK_NULL_HANDLE;
+      return;
+    }
     imageInfo->imageLayout = image->currentLayout;
     imageInfo->imageView = imageView.vk;
     imageInfo->sampler = vk;
@@ -145,6 +160,8 @@ struct CommandPoolContainer {
   VkExtent2D prevSize;
 
   // onResized is called when cpool.dev.framebufs need to be resized.
+  // The swapChain and framebufs are rebuilt but pass and its pipelines are
+  // not. Pipelines built by PipeBuilder have a dynamic viewport and scissor.
   // * Register in resizeFramebufListeners to have CommandPoolContainer
   //   automatically handle per-framebuf initialization. (It is necessary to
   //   re-initialize each one any time there is a resize event.)
@@ -214,6 +231,378 @@ typedef struct SmartCommandBuffer : public command::CommandBuffer {
   bool wantAutoSubmit{false};
 } SmartCommandBuffer;
 
+// ParallelRecorder splits a list of draws across several threads, each of
+// which records a secondary command buffer. The secondary command buffers are
+// then executed in order in a primary command buffer.
+//
+// Each worker has its own CommandPool, because a VkCommandPool must be
+// externally synchronized. Each worker also has one secondary CommandBuffer
+// per "slot": use one slot per frame in flight (such as one per framebuf),
+// and do not reuse a slot until the GPU has finished the previous frame
+// that used that slot.
+//
+// The pipeline for the subpass must have commandBufferType set to
+// VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS. See the comment on
+// Pipeline::commandBufferType for the rules for secondary command buffers.
+typedef struct ParallelRecorder {
+  ParallelRecorder(language::Device& dev) : dev(dev) {}
+  ParallelRecorder(ParallelRecorder&&) = delete;
+  ParallelRecorder(const ParallelRecorder&) = delete;
+  // The destructor stops the worker threads.
+  virtual ~ParallelRecorder();
+
+  language::Device& dev;
+
+  // ctorError creates numWorkers workers, each with a CommandPool for
+  // queueFamily and numSlots secondary CommandBuffers. The calling thread
+  // acts as worker 0, so numWorkers - 1 threads are started. numWorkers = 0
+  // uses std::thread::hardware_concurrency(). If ctorError fails, there are
+  // no workers and record() fails until ctorError succeeds.
+  WARN_UNUSED_RESULT int ctorError(
+      size_t numSlots, size_t numWorkers = 0,
+      language::SurfaceSupport queueFamily = language::GRAPHICS);
+
+  // RecordFn records draws [first, first + count) into cmd. cmd has already
+  // been begun with the render pass and subpass, and will be ended after
+  // RecordFn returns. worker is the index of the worker recording cmd.
+  // RecordFn returns non-zero to signal an error.
+  typedef std::function<int(command::CommandBuffer& cmd, size_t first,
+                            size_t count, size_t worker)>
+      RecordFn;
+
+  // record splits drawCount draws across the workers using slot. Then it
+  // calls primary.executeCommands() with the secondary command buffers in
+  // order. primary must already be in pass at subpass, such as by calling
+  // primary.beginSubpass(pass, framebuf, subpass).
+  WARN_UNUSED_RESULT int record(command::CommandBuffer& primary,
+                                command::RenderPass& pass, uint32_t subpass,
+                                language::Framebuf& framebuf, size_t slot,
+                                size_t drawCount, RecordFn fn);
+
+  // Worker holds the CommandPool and secondary CommandBuffers of a worker.
+  struct Worker {
+    Worker(language::Device& dev) : cpool(dev) {}
+    command::CommandPool cpool;
+    // bufs has one secondary command buffer for each slot.
+    std::vector<command::CommandBuffer> bufs;
+    std::thread thread;
+  };
+  std::vector<std::shared_ptr<Worker>> workers;
+
+ protected:
+  // run calls job(i) for each worker i, and returns when all are done.
+  void run(std::function<void(size_t)> job);
+  // workerMain is the main loop of the thread for worker i.
+  void workerMain(size_t i);
+  // stop stops all worker threads.
+  void stop();
+
+  std::mutex lockmutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  std::function<void(size_t)> job;
+  uint64_t generation{0};
+  size_t pending{0};
+  bool quit{false};
+} ParallelRecorder;
+
+// CachedCommandBuffer records its commands once and replays them until the
+// inputs used to record them change. For a static scene this skips recording
+// entirely.
+//
+// Each frame, your app adds everything the commands depend on to an
+// InputHash: pipelines, descriptor sets, buffers, draw parameters and the
+// framebuf. Then it calls record(). record() only calls your RecordFn if the
+// hash changed or markDirty() was called. Then enqueue() it as usual.
+//
+// CachedCommandBuffer works with CommandPool::reallocCmdBufs() to create one
+// per framebuf, and since the framebuf is part of the InputHash a resize
+// automatically re-records it.
+typedef struct CachedCommandBuffer : public command::CommandBuffer {
+  CachedCommandBuffer(command::CommandPool& cpool_) : CommandBuffer{cpool_} {}
+  // Move constructor.
+  CachedCommandBuffer(CachedCommandBuffer&& other)
+      : CommandBuffer(std::move(other)),
+        recordCount(other.recordCount),
+        replayCount(other.replayCount),
+        recordedHash(other.recordedHash),
+        dirty(other.dirty) {}
+  // The copy constructor is not allowed. The VkCommandBuffer cannot be copied.
+  CachedCommandBuffer(const CachedCommandBuffer& other) = delete;
+
+  // InputHash accumulates the inputs that the recorded commands depend on.
+  struct InputHash {
+    uint64_t value{language::hashBytes(nullptr, 0)};
+
+    InputHash& add(const void* data, size_t len) {
+      value = language::hashBytes(data, len, value);
+      return *this;
+    }
+    // add hashes any plain value, such as a Vulkan handle or a struct of
+    // draw parameters.
+    template <typename T>
+    InputHash& add(const T& v) {
+      static_assert(std::is_trivially_copyable<T>::value,
+                    "InputHash::add(T) requires a trivially copyable T");
+      return add(&v, sizeof(v));
+    }
+    // add hashes a std::vector of plain values.
+    template <typename T>
+    InputHash& add(const std::vector<T>& v) {
+      static_assert(std::is_trivially_copyable<T>::value,
+                    "InputHash::add(vector<T>) requires trivially copyable T");
+      size_t n = v.size();
+      add(n);
+      return add(v.data(), sizeof(T) * n);
+    }
+    // add hashes pipe's handles and generation, so a pipeline that is
+    // destroyed and created again is not mistaken for the old one.
+    InputHash& add(command::Pipeline& pipe) {
+      VkPipeline p = pipe.vk;
+      VkPipelineLayout l = pipe.pipelineLayout;
+      return add(p).add(l).add(pipe.generation);
+    }
+    // add hashes framebuf's handle and generation.
+    InputHash& add(language::Framebuf& framebuf) {
+      VkFramebuffer f = framebuf.vk;
+      return add(f).add(framebuf.generation);
+    }
+    // add hashes set's handle and generation, so any write() to set causes
+    // a re-record.
+    InputHash& add(memory::DescriptorSet& set) {
+      VkDescriptorSet d = set.vk;
+      return add(d).add(set.generation);
+    }
+  };
+
+  // RecordFn records the commands. It is called between begin() and end().
+  typedef std::function<int(command::CommandBuffer& cmd)> RecordFn;
+
+  // record calls begin(usageFlags), fn, and end() if isDirty(inputs).
+  // Otherwise it does nothing and the previous commands are replayed. The
+  // default usageFlags allow the buffer to be submitted again while a
+  // previous submit is still pending.
+  WARN_UNUSED_RESULT int record(
+      const InputHash& inputs, RecordFn fn,
+      VkCommandBufferUsageFlags usageFlags =
+          VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
+
+  // isDirty returns true if record() would call RecordFn.
+  bool isDirty(const InputHash& inputs) const {
+    return dirty || inputs.value != recordedHash;
+  }
+
+  // markDirty forces the next record() to call RecordFn. Use this for
+  // changes that are not part of the InputHash, such as destroying and
+  // recreating a buffer or image the commands use: only a Pipeline, Framebuf
+  // or DescriptorSet added to the InputHash is tracked by its generation.
+  //
+  // NOTE: recording resets the VkCommandBuffer. Do not call record() with a
+  //       dirty buffer while a SIMULTANEOUS_USE submit of it is still pending
+  //       on the GPU: wait for that submit first.
+  void markDirty() { dirty = true; }
+
+  // recordCount is how many times record() called RecordFn.
+  uint64_t recordCount{0};
+  // replayCount is how many times record() reused the previous commands.
+  uint64_t replayCount{0};
+
+ protected:
+  uint64_t recordedHash{0};
+  bool dirty{true};
+} CachedCommandBuffer;
+
+// RenderGraph builds a frame out of passes. Each pass declares the images and
+// buffers it reads and writes, and a RecordFn that records its commands. Then
+// RenderGraph works out the synchronization:
+//
+// * Passes are sorted so each one runs after the passes it depends on, and
+//   passes on the same queue are grouped together.
+// * Passes whose writes are never read are culled. Mark a resource that is
+//   used outside the graph (such as a swapchain image) with markOutput(), or
+//   mark a pass with sideEffect = true to keep it.
+// * Transient images are created by the graph. Transient images with the
+//   same VkImageCreateInfo whose lifetimes do not overlap share one Image.
+// * Barriers are only added for a read after a write, a write after a read or
+//   write, or a layout change. All the barriers before a pass are batched into
+//   one vkCmdPipelineBarrier.
+// * Each queue gets one vkQueueSubmit per execute(), unless passes bounce
+//   back and forth between queues. Semaphores order work across queues.
+//
+// A pass that loads or blends into an image must read() it as well as
+// write() it, or the earlier writes to the image may be culled.
+//
+// Resources used on more than one queue family must be created with
+// VK_SHARING_MODE_CONCURRENT: RenderGraph does not transfer queue family
+// ownership.
+typedef struct RenderGraph {
+  RenderGraph(language::Device& dev) : dev(dev) {}
+  RenderGraph(RenderGraph&&) = delete;
+  RenderGraph(const RenderGraph&) = delete;
+  // The destructor waits for the last execute() to finish.
+  virtual ~RenderGraph();
+
+  language::Device& dev;
+
+  // addQueue adds a queue that passes can run on. cpool must outlive the
+  // RenderGraph. Returns the queue index to pass to addPass().
+  size_t addQueue(command::CommandPool& cpool, size_t poolQindex = 0);
+
+  // importImage adds an Image owned by your app. img must outlive the
+  // RenderGraph. Returns the resource index.
+  size_t importImage(const std::string& name, memory::Image& img);
+
+  // importBuffer adds a Buffer owned by your app. buf must outlive the
+  // RenderGraph. Returns the resource index.
+  size_t importBuffer(const std::string& name, memory::Buffer& buf);
+
+  // createImage adds a transient image that the graph creates in device
+  // local memory. Its contents are undefined before the first pass that
+  // writes to it in each execute(). Returns the resource index.
+  size_t createImage(const std::string& name, const VkImageCreateInfo& info);
+
+  // getImage returns the Image of an imported or transient image. The Image
+  // of a transient image is only valid after compile().
+  memory::Image* getImage(size_t res);
+
+  // markOutput keeps the passes that write to res (and what they depend on).
+  WARN_UNUSED_RESULT int markOutput(size_t res);
+
+  // RecordFn records the commands of a pass. The graph has already added the
+  // barriers the pass needs.
+  typedef std::function<int(command::CommandBuffer& cmd)> RecordFn;
+
+  // addPass adds a pass that runs on queue. Returns the pass index.
+  size_t addPass(const std::string& name, size_t queue, RecordFn record);
+
+  // read declares that pass reads res in stage using access. For an image,
+  // layout is the layout the pass needs it in.
+  WARN_UNUSED_RESULT int read(
+      size_t pass, size_t res, VkPipelineStageFlags stage,
+      VkAccessFlags access,
+      VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED);
+
+  // write declares that pass writes res in stage using access. For an image,
+  // layout is the layout the pass needs it in. If the pass itself changes
+  // the layout (such as with a RenderPass finalLayout), set finalLayout.
+  WARN_UNUSED_RESULT int write(
+      size_t pass, size_t res, VkPipelineStageFlags stage,
+      VkAccessFlags access, VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED,
+      VkImageLayout finalLayout = VK_IMAGE_LAYOUT_UNDEFINED);
+
+  // compile sorts and culls the passes, creates transient images,
+  // semaphores and command buffers. execute() calls compile() if any
+  // passes or resources were added since the last compile().
+  WARN_UNUSED_RESULT int compile();
+
+  // execute waits for the previous execute() to finish, records all the
+  // passes and submits them.
+  WARN_UNUSED_RESULT int execute();
+
+  // wait waits for the previous execute() to finish.
+  WARN_UNUSED_RESULT int wait();
+
+  // Access is one resource used by a pass.
+  typedef struct Access {
+    size_t res;
+    VkPipelineStageFlags stage;
+    VkAccessFlags access;
+    VkImageLayout layout;
+    VkImageLayout finalLayout;
+    bool isRead;
+    bool isWrite;
+  } Access;
+
+  typedef struct Pass {
+    std::string name;
+    size_t queue;
+    RecordFn record;
+    std::vector<Access> uses;
+    // sideEffect keeps the pass even if nothing reads what it writes.
+    bool sideEffect{false};
+    // waitFor and toSignal are semaphores outside the graph, such as the
+    // swapchain semaphores. They are added to the submit that has this pass.
+    std::vector<command::SemaphoreStageMaskPair> waitFor;
+    std::vector<VkSemaphore> toSignal;
+  } Pass;
+  std::vector<Pass> passes;
+
+  typedef struct Resource {
+    std::string name;
+    memory::Image* img{nullptr};
+    memory::Buffer* buf{nullptr};
+    // info is only used for transient images.
+    VkImageCreateInfo info;
+    bool isTransient{false};
+    bool isOutput{false};
+    // slot is the index of the synchronization state, computed by compile().
+    // Transient images that share an Image share a slot.
+    size_t slot{0};
+  } Resource;
+  std::vector<Resource> resources;
+
+  // order is the passes that will run, in order. It is computed by compile().
+  std::vector<size_t> order;
+
+  // culledCount is the number of passes that compile() culled.
+  size_t culledCount{0};
+  // barrierCount is the number of barriers in the last execute().
+  size_t barrierCount{0};
+  // submitCount is the number of vkQueueSubmit calls in the last execute().
+  size_t submitCount{0};
+
+ protected:
+  struct Queue {
+    command::CommandPool* cpool;
+    size_t poolQindex;
+    std::shared_ptr<command::Fence> fence;
+  };
+  std::vector<Queue> queues;
+
+  // Run is the passes in order that are on the same queue.
+  struct Run {
+    size_t queue;
+    std::vector<size_t> passes;
+    std::shared_ptr<command::CommandBuffer> cmd;
+    // waitFor has semaphores from earlier runs on other queues. waitRuns
+    // has the index of each of those runs.
+    std::vector<command::SemaphoreStageMaskPair> waitFor;
+    std::vector<size_t> waitRuns;
+    // signal has one binary semaphore for each later run that waits on this
+    // run, because a binary semaphore can only be waited on once.
+    std::vector<std::shared_ptr<command::Semaphore>> signal;
+  };
+  std::vector<Run> runs;
+
+  // SyncState is the last use of a slot.
+  struct SyncState {
+    bool isValid{false};
+    size_t queue{0};
+    VkPipelineStageFlags writeStage{0};
+    VkAccessFlags writeAccess{0};
+    VkPipelineStageFlags readStages{0};
+    VkPipelineStageFlags visibleStages{0};
+    VkAccessFlags visibleAccess{0};
+  };
+  // slots holds the imported resources first, then the transient images.
+  std::vector<SyncState> slots;
+  size_t importedSlots{0};
+  std::vector<std::shared_ptr<memory::Image>> transientImages;
+  // deps has the passes that each pass must run after.
+  std::vector<std::vector<size_t>> deps;
+  // firstPass has the first pass in order that uses each resource.
+  std::vector<size_t> firstPass;
+
+  int addUse(size_t pass, const Access& a);
+  int sortPasses();
+  int allocTransients();
+  int buildRuns();
+  int addBarriers(size_t pass, command::CommandBuffer& cmd);
+  int submit();
+  void freeRuns();
+  bool isCompiled{false};
+} RenderGraph;
+
 // PipeBuilder is a builder for command::Pipeline.
 // PipeBuilder immediately installs a new command::Pipeline in the
 // command::RenderPass it gets in its constructor, so instantiating a
@@ -237,9 +626,16 @@ typedef struct PipeBuilder {
   // If you prefer to use deriveFrom(), it must be called before this gets
   // called because deriveFrom populates pipe a different way (which turns this
   // into a no-op).
+  //
+  // The viewport and scissor of the new pipe are dynamic state, so a resize
+  // does not have to rebuild it. Your app must call
+  // CommandBuffer::setViewportAndScissor() (or setViewport() and setScissor())
+  // when recording commands that use the pipe.
   void addPipelineOnce() {
     if (!pipe) {
       pipe = pass.addPipeline();
+      pipe->info.dynamicStates.emplace_back(VK_DYNAMIC_STATE_VIEWPORT);
+      pipe->info.dynamicStates.emplace_back(VK_DYNAMIC_STATE_SCISSOR);
     }
   }
 
@@ -252,6 +648,11 @@ typedef struct PipeBuilder {
   // deriveFrom() is for creating a pipe which you can later pass to
   // swap(other) without recreating the RenderPass.
   //
+  // The pipe is a Vulkan pipeline derivative of other.pipe: deriveFrom() adds
+  // VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT to other and sets
+  // pipe->basePipe. If other.pipe was already created without that flag, the
+  // pipe is built as a normal pipeline until other.pipe is rebuilt.
+  //
   // NOTE: deriveFrom() cannot be used after addPipelineOnce() has been called.
   int deriveFrom(PipeBuilder& other);
 
@@ -260,6 +661,16 @@ typedef struct PipeBuilder {
   // will finalize it first.
   int swap(PipeBuilder& other);
 
+  // ctorErrorAsync builds this pipe on a background thread, for the subpass
+  // where other is found in pass. other.pipe is the fallback until this pipe
+  // is ready. Poll out->isReady(), then call swap(other) when it is ready and
+  // !out->isFailed().
+  //
+  // This is for hot-swapping a pipeline without a hitch. Set up this
+  // PipeBuilder using deriveFrom(other) first.
+  WARN_UNUSED_RESULT int ctorErrorAsync(
+      PipeBuilder& other, std::shared_ptr<command::AsyncPipeline>& out);
+
   // info() returns the PipelineCreateInfo as if this were a command::Pipeline.
   command::PipelineCreateInfo& info() {
     addPipelineOnce();
@@ -346,12 +757,132 @@ typedef struct PipeBuilder {
   std::vector<VkVertexInputAttributeDescription> attributeInputs;
 } PipeBuilder;
 
+// BindlessTable is a single DescriptorSet holding a large array of
+// combined image samplers (binding = 0) and a large array of storage buffers
+// (binding = 1). Materials then refer to textures and buffers by index,
+// and draws no longer need to rebind descriptor sets.
+//
+// BindlessTable requires VK_EXT_descriptor_indexing: add it to
+// Device::requiredExtensions and enable descriptorBindingPartiallyBound,
+// descriptorBindingSampledImageUpdateAfterBind,
+// descriptorBindingStorageBufferUpdateAfterBind and runtimeDescriptorArray
+// in Device::enabledFeatures.descriptorIndexing.
+//
+// The set is created with UPDATE_AFTER_BIND and PARTIALLY_BOUND, so your app
+// can alloc() and free() slots while command buffers using the set are
+// pending, as long as the slot itself is not in use by the GPU.
+//
+// In your shaders:
+//   #extension GL_EXT_nonuniform_qualifier : require
+//   layout(set = SETI, binding = 0) uniform sampler2D textures[];
+//   layout(set = SETI, binding = 1) buffer Buffers { ... } buffers[];
+//
+// Call ctorError(), then set DescriptorLibrary::bindless before calling
+// ShaderLibrary::finalizeDescriptorLibrary() so the pipelines get a layout
+// compatible with this table at set = setI.
+typedef struct BindlessTable {
+  BindlessTable(language::Device& dev, uint32_t setI)
+      : dev(dev), setI(setI), layout{dev} {}
+
+  // dev holds a reference to the device where the table is stored.
+  language::Device& dev;
+  // setI is the "layout(set = setI)" the shaders use for this table.
+  const uint32_t setI;
+  static constexpr uint32_t imageBinding = 0;
+  static constexpr uint32_t bufferBinding = 1;
+
+  // maxImages is the size of the image array. Your app can change it before
+  // ctorError(). It is clamped to the device limits.
+  uint32_t maxImages{4096};
+  // maxBuffers is the size of the buffer array. Your app can change it before
+  // ctorError(). It is clamped to the device limits.
+  uint32_t maxBuffers{4096};
+  // stageFlags is the shader stages that can access the table.
+  VkShaderStageFlags stageFlags{VK_SHADER_STAGE_ALL};
+
+  // ctorError creates layout, pool and ds.
+  WARN_UNUSED_RESULT int ctorError();
+
+  // ctorLayout builds a DescriptorSetLayout compatible with this table. It is
+  // used by ShaderLibrary::finalizeDescriptorLibrary().
+  WARN_UNUSED_RESULT int ctorLayout(memory::DescriptorSetLayout& out);
+
+  // allocImage writes imageInfo to a free slot, and sets slot to its index.
+  WARN_UNUSED_RESULT int allocImage(const VkDescriptorImageInfo& imageInfo,
+                                    uint32_t& slot);
+
+  // allocImage is a generic method that accepts any class that implements a
+  // toDescriptor method, such as science::Sampler.
+  template <typename T>
+  WARN_UNUSED_RESULT int allocImage(T& imageResource, uint32_t& slot) {
+    VkDescriptorImageInfo imageInfo;
+    memset(&imageInfo, 0, sizeof(imageInfo));
+    imageResource.toDescriptor(&imageInfo);
+    return allocImage(imageInfo, slot);
+  }
+
+  // allocBuffer writes bufferInfo to a free slot, and sets slot to its index.
+  WARN_UNUSED_RESULT int allocBuffer(const VkDescriptorBufferInfo& bufferInfo,
+                                     uint32_t& slot);
+
+  // writeImage replaces the image at an already allocated slot.
+  WARN_UNUSED_RESULT int writeImage(uint32_t slot,
+                                    const VkDescriptorImageInfo& imageInfo);
+  // writeBuffer replaces the buffer at an already allocated slot.
+  WARN_UNUSED_RESULT int writeBuffer(uint32_t slot,
+                                     const VkDescriptorBufferInfo& bufferInfo);
+
+  // freeImage returns slot to the free list. The GPU must not be using it.
+  WARN_UNUSED_RESULT int freeImage(uint32_t slot);
+  // freeBuffer returns slot to the free list. The GPU must not be using it.
+  WARN_UNUSED_RESULT int freeBuffer(uint32_t slot);
+
+  // setName names ds, layout and pool. ctorError names them again, so the
+  // name can be set before ctorError.
+  WARN_UNUSED_RESULT int setName(const std::string& name);
+  // getName returns the name set by setName.
+  const std::string& getName() const { return debugName; }
+
+  memory::DescriptorSetLayout layout;
+  // pool must be declared before ds so ds is destroyed first.
+  std::shared_ptr<memory::DescriptorPool> pool;
+  // ds is the single DescriptorSet your app binds at set = setI.
+  std::unique_ptr<memory::DescriptorSet> ds;
+
+ protected:
+  // SlotAllocator hands out indices into one of the arrays.
+  struct SlotAllocator {
+    uint32_t max{0};
+    // next is the first index that has never been allocated.
+    uint32_t next{0};
+    // freeList holds indices that were freed and can be reused.
+    std::vector<uint32_t> freeList;
+    // used detects a double free.
+    std::vector<bool> used;
+
+    int alloc(uint32_t& slot);
+    int free(uint32_t slot);
+  };
+
+  std::string debugName{"BindlessTable"};
+  std::mutex lockmutex;
+  SlotAllocator images;
+  SlotAllocator buffers;
+} BindlessTable;
+
 // DescriptorLibrary is the DescriptorSet objects and DescriptorPool they are
 // allocated from. The DescriptorSetLayouts are computed by ShaderLibrary and
 // are treated as immutable here.
+//
+// makeSet() is thread-safe: the thread that calls finalizeDescriptorLibrary()
+// allocates from pool, and every other thread gets its own pools the first
+// time it calls makeSet(). Threads never wait on each other to allocate.
 typedef struct DescriptorLibrary {
  public:
-  DescriptorLibrary(language::Device& dev) : dev(dev) {}
+  DescriptorLibrary(language::Device& dev);
+
+  // NO_PUSH_SET means no set is a push descriptor set.
+  static constexpr size_t NO_PUSH_SET = std::numeric_limits<size_t>::max();
 
   // dev holds a reference to the device where the DescriptorSets are stored.
   language::Device& dev;
@@ -372,17 +903,23 @@ typedef struct DescriptorLibrary {
   // Further on, you call DescriptorSet::write() to populate it with data, and
   // CommandBuffer::bindGraphicsPipelineAndDescriptors while building the
   // command buffer.
+  //
+  // If setI == pushSetI, the DescriptorSet is a push descriptor set and is
+  // not allocated from any pool. Use DescriptorSet::bind() instead of
+  // bindGraphicsPipelineAndDescriptors for it, which works either way.
   std::unique_ptr<memory::DescriptorSet> makeSet(size_t setI,
                                                  size_t layoutI = 0);
 
   // isFinalized tells you whether your app has called
   // ShaderLibrary::finalizeDescriptorLibrary() yet.
-  bool isFinalized() const { return !pool.empty(); }
+  bool isFinalized() const { return !layouts.empty(); }
 
-  // setName forwards the setName call to the underlying memory::DescriptorPool
+  // setName names the pools of ownerThread. Call it on ownerThread. Other
+  // threads rename their own pools the next time they call makeSet(), since
+  // a VkDescriptorPool must not be used by two threads at once.
   WARN_UNUSED_RESULT int setName(const std::string& name);
-  // getName forwards the getName call to the underlying memory::DescriptorPool
-  const std::string& getName() const;
+  // getName returns the name set by setName. Call it on ownerThread.
+  const std::string& getName() const { return debugName; }
 
   // layouts are the number and type of descriptor object needed to make a
   // DescriptorSet, filled by ShaderLibrary and treated as immutable here.
@@ -408,6 +945,58 @@ typedef struct DescriptorLibrary {
   // NOTE: DescriptorPoolSizes is a typedef of a std::map. Its value is the
   // memory::DescriptorPool::sizes member.
   std::map<memory::DescriptorPoolSizes, memory::DescriptorPool> pool;
+
+  // bindless, if set before ShaderLibrary::finalizeDescriptorLibrary(),
+  // replaces the reflected layout at set = bindless->setI. makeSet() then
+  // refuses to allocate that set - bind bindless->ds instead.
+  std::shared_ptr<BindlessTable> bindless;
+
+  // hints, if set before ShaderLibrary::finalizeDescriptorLibrary(), is
+  // shared by every pool (including pools created for other threads).
+  // Example:
+  //   library.hints = std::make_shared<memory::DescriptorPoolHints>();
+  //   if (library.hints->load("descriptor.hints")) { ... handle errors ... }
+  //   ... finalizeDescriptorLibrary, run the app ...
+  //   if (library.hints->save("descriptor.hints")) { ... handle errors ... }
+  std::shared_ptr<memory::DescriptorPoolHints> hints;
+
+  // pushSetI is set by ShaderLibrary::finalizeDescriptorLibrary() to the set
+  // index that uses VK_KHR_push_descriptor, or NO_PUSH_SET.
+  size_t pushSetI{NO_PUSH_SET};
+
+  // ThreadPools holds the pools used by one thread other than ownerThread.
+  // Only that thread reads or writes it.
+  struct ThreadPools {
+    std::map<memory::DescriptorPoolSizes, memory::DescriptorPool> pools;
+    // nameGen is the DescriptorLibrary::nameGen that pools were named with.
+    uint64_t nameGen{0};
+  };
+
+ protected:
+  friend class ShaderLibrary;
+
+  // getPool returns the pool makeSet() should use on this thread, or NULL
+  // if there is no pool for sizes.
+  memory::DescriptorPool* getPool(const memory::DescriptorPoolSizes& sizes);
+
+  // id is the key to find this library's ThreadPools in a thread_local map.
+  const uint64_t id;
+  // ownerThread is the thread that called finalizeDescriptorLibrary.
+  std::thread::id ownerThread;
+  // debugName is applied to ThreadPools by the thread that owns them. It is
+  // protected by threadsMutex.
+  std::string debugName;
+  // nameGen is incremented by setName, so other threads can tell when to
+  // rename their pools without locking threadsMutex in every makeSet().
+  std::atomic<uint64_t> nameGen{0};
+  // threadsMutex protects threads, which only changes when a thread calls
+  // makeSet() for the first time, and debugName.
+  std::mutex threadsMutex;
+  // threads owns all ThreadPools, so they are destroyed with this library.
+  std::vector<std::shared_ptr<ThreadPools>> threads;
+  // pushParent is the DescriptorSet::parent of push descriptor sets. It is
+  // never used to allocate.
+  memory::DescriptorPool pushParent;
 } DescriptorLibrary;
 
 struct ShaderLibraryInternal;
@@ -481,19 +1070,24 @@ class ShaderLibrary {
   //
   // Note: you MUST call add() at least once before calling
   // finalizeDescriptorLibrary.
-  int finalizeDescriptorLibrary(DescriptorLibrary& descriptorLibrary);
+  //
+  // pushSetI optionally marks one set index (in every layoutI) as a push
+  // descriptor set. That is a good fit for a small set that changes every
+  // draw: the writes go directly into the command buffer, skipping the
+  // DescriptorPool entirely. If VK_KHR_push_descriptor is not loaded or the
+  // set does not qualify, pushSetI is ignored and the set is allocated from
+  // a DescriptorPool as usual. Check descriptorLibrary.pushSetI to find out.
+  int finalizeDescriptorLibrary(
+      DescriptorLibrary& descriptorLibrary,
+      size_t pushSetI = DescriptorLibrary::NO_PUSH_SET);
 
  protected:
   friend struct ShaderLibraryInternal;
 
   struct ShaderBinding {
+    // layouts has the stageFlags of each binding set to just the stages that
+    // use it.
     std::vector<VkDescriptorSetLayoutBinding> layouts;
-    // allStageBits collects all the stages found as the shaders are loaded.
-    // It is then written to every layout.stageFlags in layouts.
-    //
-    // A more efficient solution would look at the layouts on a per-stage basis
-    // but that would make this more complicated.
-    uint32_t allStageBits{0};
   };
 
   std::vector<std::vector<ShaderBinding>>& getBindings();
@@ -839,4 +1433,83 @@ typedef struct InstanceBuf {
   VkDeviceSize ofs{0};
 } InstanceBuf;
 
+// IndirectDrawBatcher packs the cmd of many InstanceBuf into one GPU buffer,
+// so a whole group of draws is a single drawIndexedIndirect (or a single
+// drawIndexedIndirectCount if VK_KHR_draw_indirect_count is loaded). A group
+// is all the commands added for the same Pipeline and instance buffer (vk and
+// ofs). Groups are drawn in the order they were first added.
+//
+// Each frame:
+// 1. Call reset(), then add() each InstanceBuf.
+// 2. Call upload() to write all commands to buf.
+// 3. In the render pass, call draw(). It calls BindFn for each group to bind
+//    the pipeline and buffers, then writes the indirect draw.
+//
+// buf is host visible and stays mapped, so upload() writes it directly and
+// never waits for the GPU. That means upload() must not overwrite buf while
+// the GPU may still read it: use one IndirectDrawBatcher per frame in flight
+// and only call upload() after that frame's fence has signalled.
+typedef struct IndirectDrawBatcher {
+  IndirectDrawBatcher(language::Device& dev) : buf{dev} {}
+  IndirectDrawBatcher(IndirectDrawBatcher&&) = delete;
+  IndirectDrawBatcher(const IndirectDrawBatcher&) = delete;
+  ~IndirectDrawBatcher() {
+    if (mapped) {
+      buf.mem.munmap();
+    }
+  }
+
+  // reset removes all commands.
+  void reset() {
+    groups.clear();
+    groupIndex.clear();
+    total = 0;
+    uploaded = false;
+  }
+
+  // add appends ib.cmd to the group for pipe, ib.vk and ib.ofs.
+  void add(std::shared_ptr<command::Pipeline> pipe, const InstanceBuf& ib);
+
+  // upload writes all commands to buf, growing buf if needed.
+  WARN_UNUSED_RESULT int upload();
+
+  // BindFn must bind pipe and its buffers (such as instanceBuf at ofs).
+  typedef std::function<int(command::CommandBuffer& cmd,
+                            command::Pipeline& pipe, VkBuffer instanceBuf,
+                            VkDeviceSize ofs)>
+      BindFn;
+
+  // draw calls fn and writes an indirect draw for each group. If the
+  // multiDrawIndirect feature is not enabled, each command is drawn on its
+  // own.
+  WARN_UNUSED_RESULT int draw(command::CommandBuffer& cmd, BindFn fn);
+
+  // size returns the number of commands added since reset.
+  size_t size() const { return total; }
+
+  // drawCalls is the number of indirect draws written by the last draw().
+  size_t drawCalls{0};
+
+  // buf holds all the commands, followed by a uint32_t count for each group
+  // (used by drawIndexedIndirectCount).
+  memory::Buffer buf;
+
+ protected:
+  struct Group {
+    std::shared_ptr<command::Pipeline> pipe;
+    VkBuffer instanceBuf;
+    VkDeviceSize ofs;
+    std::vector<VkDrawIndexedIndirectCommand> cmds;
+    // first is the index in buf of the first command in cmds.
+    size_t first{0};
+  };
+  std::vector<Group> groups;
+  std::map<std::tuple<command::Pipeline*, VkBuffer, VkDeviceSize>, size_t>
+      groupIndex;
+  size_t total{0};
+  bool uploaded{false};
+  // mapped is buf.mem mapped into host memory, or NULL before upload().
+  void* mapped{nullptr};
+} IndirectDrawBatcher;
+
 }  // namespace science
@@ -0,0 +1,207 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ *
+ * Unit tests for code in src/command. These do not need a GPU: no Vulkan
+ * object is created.
+ */
+
+#include "gtest/gtest.h"
+
+// command.h must be #included after gtest/gtest.h
+#include <src/command/command.h>
+
+namespace {  // An anonymous namespace keeps any definition local to this file.
+
+// CommandBufferWithAccess exposes protected methods for testing.
+struct CommandBufferWithAccess : public command::CommandBuffer {
+  CommandBufferWithAccess(command::CommandPool& cpool)
+      : command::CommandBuffer(cpool) {}
+
+  void mergeLazyBarriers() { command::CommandBuffer::mergeLazyBarriers(); }
+};
+
+// FAKE_IMAGE is never passed to Vulkan.
+static const VkImage FAKE_IMAGE = (VkImage)(uintptr_t)0x1000;
+
+class MergeLazyBarriers : public ::testing::Test {
+ protected:
+  MergeLazyBarriers() : dev(inst, VK_NULL_HANDLE), cpool(dev), cmd(cpool) {}
+
+  language::Instance inst;
+  language::Device dev;
+  command::CommandPool cpool;
+  CommandBufferWithAccess cmd;
+
+  VkImageMemoryBarrier img(VkImageLayout oldLayout, VkImageLayout newLayout,
+                           VkAccessFlags srcAccess, VkAccessFlags dstAccess,
+                           uint32_t mip = 0) {
+    VkImageMemoryBarrier b;
+    memset(&b, 0, sizeof(b));
+    b.sType = autoSType(b);
+    b.image = FAKE_IMAGE;
+    b.oldLayout = oldLayout;
+    b.newLayout = newLayout;
+    b.srcAccessMask = srcAccess;
+    b.dstAccessMask = dstAccess;
+    b.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    b.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    b.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    b.subresourceRange.baseMipLevel = mip;
+    b.subresourceRange.levelCount = 1;
+    b.subresourceRange.layerCount = 1;
+    return b;
+  }
+};
+
+TEST_F(MergeLazyBarriers, CollapseChain) {
+  auto& b = cmd.lazyBarriers.img;
+  b.emplace_back(img(VK_IMAGE_LAYOUT_UNDEFINED,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0,
+                     VK_ACCESS_TRANSFER_WRITE_BIT));
+  b.emplace_back(img(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                     VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                     VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT));
+  cmd.mergeLazyBarriers();
+  ASSERT_EQ(b.size(), size_t(1));
+  EXPECT_EQ(b.at(0).oldLayout, VK_IMAGE_LAYOUT_UNDEFINED);
+  EXPECT_EQ(b.at(0).newLayout, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  EXPECT_EQ(b.at(0).srcAccessMask, VkAccessFlags(VK_ACCESS_TRANSFER_WRITE_BIT));
+  EXPECT_EQ(b.at(0).dstAccessMask, VkAccessFlags(VK_ACCESS_SHADER_READ_BIT));
+  EXPECT_EQ(cmd.barriersElided, uint64_t(1));
+}
+
+TEST_F(MergeLazyBarriers, MergeDuplicates) {
+  auto& b = cmd.lazyBarriers.img;
+  b.emplace_back(img(VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL,
+                     VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT));
+  b.emplace_back(img(VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL,
+                     VK_ACCESS_TRANSFER_WRITE_BIT,
+                     VK_ACCESS_TRANSFER_READ_BIT));
+  cmd.mergeLazyBarriers();
+  ASSERT_EQ(b.size(), size_t(1));
+  EXPECT_EQ(b.at(0).srcAccessMask,
+            VkAccessFlags(VK_ACCESS_SHADER_WRITE_BIT |
+                          VK_ACCESS_TRANSFER_WRITE_BIT));
+  EXPECT_EQ(b.at(0).dstAccessMask,
+            VkAccessFlags(VK_ACCESS_SHADER_READ_BIT |
+                          VK_ACCESS_TRANSFER_READ_BIT));
+}
+
+TEST_F(MergeLazyBarriers, DropNoOp) {
+  auto& b = cmd.lazyBarriers.img;
+  b.emplace_back(img(VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL, 0, 0));
+  cmd.mergeLazyBarriers();
+  EXPECT_EQ(b.size(), size_t(0));
+  EXPECT_EQ(cmd.barriersElided, uint64_t(1));
+}
+
+TEST_F(MergeLazyBarriers, KeepDifferentRanges) {
+  auto& b = cmd.lazyBarriers.img;
+  b.emplace_back(img(VK_IMAGE_LAYOUT_UNDEFINED,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0,
+                     VK_ACCESS_TRANSFER_WRITE_BIT, 0));
+  b.emplace_back(img(VK_IMAGE_LAYOUT_UNDEFINED,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0,
+                     VK_ACCESS_TRANSFER_WRITE_BIT, 1));
+  cmd.mergeLazyBarriers();
+  ASSERT_EQ(b.size(), size_t(2));
+  EXPECT_EQ(b.at(0).subresourceRange.baseMipLevel, uint32_t(0));
+  EXPECT_EQ(b.at(1).subresourceRange.baseMipLevel, uint32_t(1));
+  EXPECT_EQ(cmd.barriersElided, uint64_t(0));
+}
+
+TEST_F(MergeLazyBarriers, CombineMemoryBarriers) {
+  auto& mem = cmd.lazyBarriers.mem;
+  for (auto access : {VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_HOST_WRITE_BIT}) {
+    VkMemoryBarrier m;
+    memset(&m, 0, sizeof(m));
+    m.sType = autoSType(m);
+    m.srcAccessMask = access;
+    m.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    mem.emplace_back(m);
+  }
+  cmd.mergeLazyBarriers();
+  ASSERT_EQ(mem.size(), size_t(1));
+  EXPECT_EQ(mem.at(0).srcAccessMask,
+            VkAccessFlags(VK_ACCESS_SHADER_WRITE_BIT |
+                          VK_ACCESS_HOST_WRITE_BIT));
+  EXPECT_EQ(cmd.barriersElided, uint64_t(1));
+}
+
+// FAKE_PIPE, FAKE_PIPE2 and FAKE_BUF are never passed to Vulkan.
+static const VkPipeline FAKE_PIPE = (VkPipeline)(uintptr_t)0x2000;
+static const VkPipeline FAKE_PIPE2 = (VkPipeline)(uintptr_t)0x2001;
+static const VkBuffer FAKE_BUF = (VkBuffer)(uintptr_t)0x3000;
+
+TEST(ShadowState, DisabledByDefault) {
+  command::CommandBuffer::ShadowState shadow;
+  EXPECT_FALSE(shadow.isEnabled());
+  auto gfx = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  EXPECT_FALSE(shadow.redundantPipeline(gfx, FAKE_PIPE));
+  EXPECT_FALSE(shadow.redundantPipeline(gfx, FAKE_PIPE));
+  EXPECT_FALSE(shadow.redundantLineWidth(1.f));
+  EXPECT_FALSE(shadow.redundantLineWidth(1.f));
+  EXPECT_EQ(shadow.elided, uint64_t(0));
+}
+
+TEST(ShadowState, SkipRedundantBinds) {
+  command::CommandBuffer::ShadowState shadow;
+  shadow.setEnabled(true);
+  auto gfx = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  EXPECT_FALSE(shadow.redundantPipeline(gfx, FAKE_PIPE));
+  EXPECT_TRUE(shadow.redundantPipeline(gfx, FAKE_PIPE));
+  // The compute bind point is separate.
+  EXPECT_FALSE(shadow.redundantPipeline(VK_PIPELINE_BIND_POINT_COMPUTE,
+                                        FAKE_PIPE));
+
+  VkBuffer bufs[2] = {FAKE_BUF, FAKE_BUF};
+  VkDeviceSize offsets[2] = {0, 256};
+  EXPECT_FALSE(shadow.redundantVertexBuffers(0, 2, bufs, offsets));
+  EXPECT_TRUE(shadow.redundantVertexBuffers(0, 2, bufs, offsets));
+  EXPECT_TRUE(shadow.redundantVertexBuffers(1, 1, &bufs[1], &offsets[1]));
+  offsets[1] = 512;
+  EXPECT_FALSE(shadow.redundantVertexBuffers(0, 2, bufs, offsets));
+
+  EXPECT_FALSE(shadow.redundantIndexBuffer(FAKE_BUF, 0, VK_INDEX_TYPE_UINT32));
+  EXPECT_TRUE(shadow.redundantIndexBuffer(FAKE_BUF, 0, VK_INDEX_TYPE_UINT32));
+  EXPECT_FALSE(shadow.redundantIndexBuffer(FAKE_BUF, 0, VK_INDEX_TYPE_UINT16));
+  EXPECT_EQ(shadow.elided, uint64_t(4));
+}
+
+TEST(ShadowState, NewPipelineResetsDynamicState) {
+  command::CommandBuffer::ShadowState shadow;
+  shadow.setEnabled(true);
+  auto gfx = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  VkViewport vp;
+  memset(&vp, 0, sizeof(vp));
+  vp.width = 640;
+  vp.height = 480;
+  vp.maxDepth = 1;
+  EXPECT_FALSE(shadow.redundantPipeline(gfx, FAKE_PIPE));
+  EXPECT_FALSE(shadow.redundantViewports(0, 1, &vp));
+  EXPECT_TRUE(shadow.redundantViewports(0, 1, &vp));
+  EXPECT_TRUE(shadow.redundantPipeline(gfx, FAKE_PIPE));
+  EXPECT_TRUE(shadow.redundantViewports(0, 1, &vp));
+  // A different pipeline may overwrite the viewport.
+  EXPECT_FALSE(shadow.redundantPipeline(gfx, FAKE_PIPE2));
+  EXPECT_FALSE(shadow.redundantViewports(0, 1, &vp));
+}
+
+TEST(ShadowState, SetEnabledResets) {
+  command::CommandBuffer::ShadowState shadow;
+  shadow.setEnabled(true);
+  auto gfx = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  EXPECT_FALSE(shadow.redundantPipeline(gfx, FAKE_PIPE));
+  EXPECT_TRUE(shadow.redundantPipeline(gfx, FAKE_PIPE));
+  // setEnabled(true) again is not a change and keeps the state.
+  shadow.setEnabled(true);
+  EXPECT_TRUE(shadow.redundantPipeline(gfx, FAKE_PIPE));
+
+  // Binds while disabled are not recorded, so re-enabling forgets everything.
+  shadow.setEnabled(false);
+  EXPECT_FALSE(shadow.redundantPipeline(gfx, FAKE_PIPE2));
+  shadow.setEnabled(true);
+  EXPECT_FALSE(shadow.redundantPipeline(gfx, FAKE_PIPE));
+  EXPECT_EQ(shadow.elided, uint64_t(2));
+}
+
+}  // End of anonymous namespace
@@ -0,0 +1,244 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ *
+ * Unit tests for code in src/memory. These do not need a GPU: no Vulkan
+ * object is created.
+ */
+
+#include "gtest/gtest.h"
+
+// memory.h must be #included after gtest/gtest.h
+#include <src/memory/memory.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+namespace {  // An anonymous namespace keeps any definition local to this file.
+
+// FAKE_IMAGE is never passed to Vulkan. makeTransitions() only copies it into
+// each barrier. (~Image logs an error because dev.dev is VK_NULL_HANDLE.)
+static const VkImage FAKE_IMAGE = (VkImage)(uintptr_t)0x1000;
+
+class ImageLayout : public ::testing::Test {
+ protected:
+  ImageLayout() : dev(inst, VK_NULL_HANDLE), img(dev) {
+    img.info.mipLevels = 4;
+    img.info.arrayLayers = 2;
+    img.currentLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    *&img.vk = FAKE_IMAGE;
+  }
+
+  language::Instance inst;
+  language::Device dev;
+  memory::Image img;
+
+  VkImageSubresourceRange range(uint32_t mip, uint32_t mipCount,
+                                uint32_t layer, uint32_t layerCount) {
+    VkImageSubresourceRange r;
+    memset(&r, 0, sizeof(r));
+    r.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    r.baseMipLevel = mip;
+    r.levelCount = mipCount;
+    r.baseArrayLayer = layer;
+    r.layerCount = layerCount;
+    return r;
+  }
+};
+
+TEST_F(ImageLayout, WholeImage) {
+  img.setLayout(range(0, 4, 0, 2), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  EXPECT_FALSE(img.hasMixedLayouts());
+  EXPECT_EQ(img.currentLayout, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  EXPECT_EQ(img.getLayout(3, 1), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+}
+
+TEST_F(ImageLayout, PartialThenCollapse) {
+  // Transition mip 1 of layer 0 only.
+  img.setLayout(range(1, 1, 0, 1), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  ASSERT_TRUE(img.hasMixedLayouts());
+  EXPECT_EQ(img.getLayout(0, 0), VK_IMAGE_LAYOUT_UNDEFINED);
+  EXPECT_EQ(img.getLayout(1, 0), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  EXPECT_EQ(img.getLayout(1, 1), VK_IMAGE_LAYOUT_UNDEFINED);
+
+  // Moving every other subresource to the same layout collapses subLayout.
+  img.setLayout(range(0, 1, 0, 2), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  img.setLayout(range(1, 3, 1, 1), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  EXPECT_TRUE(img.hasMixedLayouts());
+  img.setLayout(range(2, 2, 0, 1), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  EXPECT_FALSE(img.hasMixedLayouts());
+  EXPECT_EQ(img.currentLayout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+}
+
+TEST_F(ImageLayout, RemainingLevels) {
+  img.setLayout(range(2, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS),
+                VK_IMAGE_LAYOUT_GENERAL);
+  ASSERT_TRUE(img.hasMixedLayouts());
+  EXPECT_EQ(img.getLayout(1, 1), VK_IMAGE_LAYOUT_UNDEFINED);
+  EXPECT_EQ(img.getLayout(3, 1), VK_IMAGE_LAYOUT_GENERAL);
+}
+
+TEST_F(ImageLayout, MakeTransitionsSkipsDoneParts) {
+  img.setLayout(range(0, 2, 0, 2), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  std::vector<VkImageMemoryBarrier> out;
+  ASSERT_EQ(img.makeTransitions(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                range(0, 4, 0, 2), out),
+            0);
+  // Mips 0-1 are already in TRANSFER_DST. Mips 2-3 of both layers share one
+  // barrier.
+  ASSERT_EQ(out.size(), size_t(1));
+  EXPECT_EQ(out.at(0).image, FAKE_IMAGE);
+  EXPECT_EQ(out.at(0).oldLayout, VK_IMAGE_LAYOUT_UNDEFINED);
+  EXPECT_EQ(out.at(0).newLayout, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  EXPECT_EQ(out.at(0).subresourceRange.baseMipLevel, uint32_t(2));
+  EXPECT_EQ(out.at(0).subresourceRange.levelCount, uint32_t(2));
+  EXPECT_EQ(out.at(0).subresourceRange.baseArrayLayer, uint32_t(0));
+  EXPECT_EQ(out.at(0).subresourceRange.layerCount, uint32_t(2));
+}
+
+TEST_F(ImageLayout, MakeTransitionsOutOfRange) {
+  std::vector<VkImageMemoryBarrier> out;
+  EXPECT_NE(img.makeTransitions(VK_IMAGE_LAYOUT_GENERAL, range(3, 2, 0, 1),
+                                out),
+            0);
+  EXPECT_EQ(out.size(), size_t(0));
+}
+
+// readFile returns the contents of filename, or "" if it cannot be read.
+std::string readFile(const char* filename) {
+  std::string r;
+  FILE* f = fopen(filename, "rb");
+  if (!f) {
+    return r;
+  }
+  char buf[256];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    r.append(buf, n);
+  }
+  fclose(f);
+  return r;
+}
+
+// writeFile replaces filename with data, without using writeFileAtomic.
+void writeFile(const char* filename, const std::string& data) {
+  FILE* f = fopen(filename, "wb");
+  ASSERT_TRUE(f != nullptr);
+  ASSERT_EQ(fwrite(data.data(), 1, data.size(), f), data.size());
+  ASSERT_EQ(fclose(f), 0);
+}
+
+TEST(WriteFileAtomic, Replace) {
+  static const char name[] = "memory_test_atomic.txt";
+  std::string a("first contents\n");
+  std::string b("second\n");
+  ASSERT_EQ(writeFileAtomic(name, a.data(), a.size()), 0);
+  EXPECT_EQ(readFile(name), a);
+  ASSERT_EQ(writeFileAtomic(name, b.data(), b.size()), 0);
+  EXPECT_EQ(readFile(name), b);
+
+#ifndef _WIN32
+  // No temporary file is left behind.
+  std::string prefix(name);
+  prefix += '.';
+  DIR* dir = opendir(".");
+  ASSERT_TRUE(dir != nullptr);
+  for (struct dirent* e; (e = readdir(dir)) != nullptr;) {
+    EXPECT_NE(std::string(e->d_name).compare(0, prefix.size(), prefix), 0)
+        << "leftover " << e->d_name;
+  }
+  closedir(dir);
+#endif
+  EXPECT_EQ(remove(name), 0);
+}
+
+TEST(HashBytes, Basics) {
+  static const char abc[] = "abcdef";
+  EXPECT_EQ(language::hashBytes(abc, 6), language::hashBytes(abc, 6));
+  EXPECT_NE(language::hashBytes(abc, 6), language::hashBytes(abc, 5));
+  EXPECT_NE(language::hashBytes("abcdeg", 6), language::hashBytes(abc, 6));
+  // Chaining through seed is the same as hashing the concatenation.
+  EXPECT_EQ(language::hashBytes(abc + 2, 4, language::hashBytes(abc, 2)),
+            language::hashBytes(abc, 6));
+  // FNV-1a of no bytes is the offset basis.
+  EXPECT_EQ(language::hashBytes(nullptr, 0), 0xcbf29ce484222325ull);
+}
+
+class PoolHints : public ::testing::Test {
+ protected:
+  PoolHints() {
+    VkDescriptorPoolSize s;
+    s.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    s.descriptorCount = 2;
+    a[s.type] = s;
+    s.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    s.descriptorCount = 3;
+    a[s.type] = s;
+    s.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    s.descriptorCount = 1;
+    b[s.type] = s;
+  }
+  ~PoolHints() { (void)remove(name); }
+
+  const char* name = "memory_test_hints.txt";
+  memory::DescriptorPoolSizes a, b;
+};
+
+TEST_F(PoolHints, RoundTrip) {
+  memory::DescriptorPoolHints out;
+  out.observe(a, 7);
+  out.observe(a, 5);  // Not a new peak.
+  out.observe(b, 40);
+  ASSERT_EQ(out.save(name), 0);
+
+  memory::DescriptorPoolHints in;
+  ASSERT_EQ(in.load(name), 0);
+  EXPECT_EQ(in.get(a), size_t(7));
+  EXPECT_EQ(in.get(b), size_t(40));
+  memory::DescriptorPoolSizes none;
+  EXPECT_EQ(in.get(none), size_t(0));
+}
+
+TEST_F(PoolHints, MissingFile) {
+  (void)remove(name);
+  memory::DescriptorPoolHints in;
+  EXPECT_EQ(in.load(name), 0);
+  EXPECT_EQ(in.get(a), size_t(0));
+}
+
+TEST_F(PoolHints, CorruptFile) {
+  writeFile(name, "not a hints file\n7 6=2 1=3\n");
+  memory::DescriptorPoolHints in;
+  EXPECT_EQ(in.load(name), 0);
+  EXPECT_EQ(in.get(a), size_t(0));
+
+  writeFile(name, "");
+  EXPECT_EQ(in.load(name), 0);
+  EXPECT_EQ(in.get(a), size_t(0));
+}
+
+TEST_F(PoolHints, TruncatedFile) {
+  memory::DescriptorPoolHints out;
+  out.observe(a, 7);
+  out.observe(b, 40);
+  ASSERT_EQ(out.save(name), 0);
+  std::string data = readFile(name);
+  ASSERT_GT(data.size(), size_t(4));
+
+  // Cut the last line short. That line is malformed and skipped; the rest is
+  // still loaded.
+  std::string cut = data.substr(0, data.size() - 3);
+  writeFile(name, cut);
+  memory::DescriptorPoolHints in;
+  ASSERT_EQ(in.load(name), 0);
+  size_t loaded = (in.get(a) == 7) + (in.get(b) == 40);
+  EXPECT_EQ(loaded, size_t(1));
+
+  // Garbage in the middle of a line is also skipped.
+  writeFile(name, data + "12 6=x\n");
+  memory::DescriptorPoolHints in2;
+  ASSERT_EQ(in2.load(name), 0);
+  EXPECT_EQ(in2.get(a), size_t(7));
+  EXPECT_EQ(in2.get(b), size_t(40));
+}
+
+}  // End of anonymous namespace